@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,214 +11,5514 @@
 #include <errno.h>
 #include <time.h>        
 #include <stdatomic.h>  // Added for atomic operations
+#include <stdint.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/xattr.h>
+#include <sys/resource.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
+#include <linux/ioprio.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
 
-#define MAX_PATH_LENGTH 4096
 #define MAX_THREADS 8
-#define QUEUE_SIZE 1000
+#define QUEUE_SIZE 1000     // Initial queue capacity; the queue grows on demand
+#define QUERY_BATCH 1024     // Rows evaluated per vectorized query step
+#define PROBE_THREADS 2      // Side pool threads for SEEK_DATA/SEEK_HOLE probes
+#define PROBE_QUEUE_SIZE 256 // Probes are dropped rather than stall the walk
+#define CONTENT_THREADS 4    // Readers classifying files by magic bytes
+#define CONTENT_QUEUE_SIZE 4096
+#define CONTENT_READ_SIZE 4096
+#define SIDE_POOL_MAX_THREADS 8
+#define FD_SPARE 4           // Spill, trace and other one-off files outside the fd budget
+#define FD_BUDGET_MIN 16     // Directory fds kept before perf counters get any
+#define METRIC_SLOTS (MAX_THREADS + 2 * SIDE_POOL_MAX_THREADS)  // Scan threads, then side pools
+#define VISITED_SHARDS 256   // Lock stripes of the followed-directory set
+#define DIRENT_BUF_SIZE 32768
+#define SPILL_BUF_SIZE (1 << 20)  // Spill file write buffer and reload chunk
+#define LF_RING_SIZE 4096    // Lock-free ring slots (power of two)
+#define PUSH_BATCH 64        // Subdirectories a worker queues per push
+#define POP_BATCH 4          // Directories a worker takes per pop
+#define QUEUE_SPINS 128      // Polls of an empty queue before parking
+#define ASYNC_THREADS 2      // Event loop threads of the async engine
+#define ASYNC_VISITS 256     // Directories in progress per async thread
+#define ASYNC_RING_ENTRIES 256
+#define ASYNC_DIRENT_SIZE 4096
+#define ASYNC_POP_BATCH 16
+#define OUTPUT_BLOCK_SIZE (1 << 20)  // Output is written in blocks of this size
+#define OUTPUT_ALIGN 4096            // O_DIRECT buffer and length alignment
+#define OUTPUT_BUFFERS 2             // Blocks per writer: one filling, one in flight
+#define TRACE_RING_EVENTS 16384      // Spans kept per thread; older ones are overwritten
+#define METRIC_ERRNOS 134            // errno values counted apart; larger ones share the last slot
+#define STAT_BUCKETS 8
+#define ERROR_RETRIES 5              // Attempts at an operation failing with a transient errno
+#define ERROR_BACKOFF_US 1000        // First retry delay, doubled per attempt
+#define ERROR_REPORT_LIMIT 10        // Failures described on stderr; the rest are only counted
+#define THROTTLE_BURST_MS 100        // Unused budget a bucket may bank
+#define THROTTLE_SLICE_MS 100        // Longest sleep between checks for a stop
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
 
 typedef struct {
-    char path[MAX_PATH_LENGTH];
+    const char* path;
     off_t size;
     mode_t mode;
     time_t mtime;
+    uid_t uid;
+    gid_t gid;
 } FileInfo;
 
+// A directory to visit. Nodes keep a reference on their parent so the full
+// path can be rebuilt at any depth, and the parent keeps its directory fd
+// open until every child has been opened relative to it.
+typedef struct DirNode {
+    struct DirNode* parent;  // NULL for the scan root
+    atomic_int refs;         // The node's own visit plus each live child
+    atomic_int fd_users;     // The node's listing plus each child not yet opened
+    int fd;                  // Kept for children's openat, or -1
+    int fd_pins;             // Listing and openat calls using fd
+    struct DirNode* lru_prev;  // Idle cached fds, oldest first
+    struct DirNode* lru_next;
+    uint32_t top_id;         // Top-level directory this node lies under
+    size_t name_len;
+    char name[];             // Entry name; the root holds the root path
+} DirNode;
+
+// Directory fds cached on nodes for their children's openat. Idle ones, not
+// pinned by a listing or an openat in flight, sit in an LRU list and the
+// oldest is closed to make room; a child whose parent lost its fd reopens
+// and caches it again. The mutex guards the list, fd and fd_pins of nodes.
+typedef struct {
+    pthread_mutex_t mutex;
+    DirNode* lru_head;
+    DirNode* lru_tail;
+    int open;            // Fds cached on nodes
+    int limit;
+    atomic_long evictions;
+    atomic_long reopens;
+} FdBudget;
+
+// Overflow of a bounded queue: records of {u32 top_id, u32 len, path
+// relative to the root}, appended at write_off and consumed from read_off
+typedef struct {
+    int fd;              // Unlinked temp file, -1 until the first spill
+    char* buf;           // Pending writes
+    size_t len;
+    off_t write_off;
+    off_t read_off;
+    char* chunk;         // Reload buffer
+    size_t chunk_cap;
+    char* scratch;       // Relative path being serialized
+    size_t scratch_cap;
+    long count;          // Records in the file not yet reloaded
+    long total;          // Records ever spilled
+} SpillFile;
+
+#ifdef LOCKFREE_QUEUE
+// Ring slot: seq == pos means free for the push at pos, seq == pos + 1 means
+// filled for the pop at pos
+typedef struct {
+    atomic_size_t seq;
+    DirNode* node;
+} LfSlot;
+#endif
+
+// Eventcount idle workers park on. Producers only make the wake syscall
+// while someone sleeps.
+typedef struct {
+    _Alignas(64) atomic_uint seq;   // Futex word, bumped by every wake
+    atomic_int sleepers;
+    atomic_long parks;              // Futex waits, for the end-of-scan summary
+} Parker;
+
+// With LOCKFREE_QUEUE, pushes and pops go through a bounded lock-free ring;
+// items/spill behind the mutex only hold what overflows it
 typedef struct {
-    char paths[QUEUE_SIZE][MAX_PATH_LENGTH];
+#ifdef LOCKFREE_QUEUE
+    LfSlot* slots;
+    size_t mask;
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+#endif
+    Parker parker;
+    atomic_int queued;   // Items behind the mutex, spilled ones included
+    DirNode** items;
+    int capacity;
     int front;
     int rear;
     int count;
+    int window;          // In-memory item limit, 0 = unbounded
+    DirNode* root;       // Parent of reloaded items, pinned for the scan
+    SpillFile spill;
     pthread_mutex_t mutex;
-    pthread_cond_t not_empty;
-    pthread_cond_t not_full;
-    int waiting_threads;
-    atomic_int active_processes;  // Added: Counter for active processes
+    atomic_int pending;  // Directories queued or being processed
+    atomic_int done;     // Set once pending drops to zero
 } WorkQueue;
 
+typedef struct {
+    char* path;
+    off_t size;
+    mode_t mode;
+    time_t mtime;
+} IndexEntry;
+
+typedef struct {
+    IndexEntry* entries;
+    size_t count;
+    size_t cap;
+    pthread_mutex_t mutex;
+} ScanIndex;
+
 WorkQueue work_queue;
 pthread_t thread_pool[MAX_THREADS];
 volatile sig_atomic_t running = 1;
-FILE* output_file;
-pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+FILE* output_file;      // Manifest when sharding
+atomic_long output_async_blocks;  // Output blocks written through io_uring
+atomic_long output_stalls;        // Waits for a block still in flight
+atomic_llong output_stall_ns;
+ScanIndex* scan_index;  // When set, records are also collected here
 
-void queue_init(WorkQueue* queue) {
-    queue->front = 0;
-    queue->rear = -1;
-    queue->count = 0;
-    queue->waiting_threads = 0;
-    atomic_init(&queue->active_processes, 0);  // Initialize active processes counter
-    pthread_mutex_init(&queue->mutex, NULL);
-    pthread_cond_init(&queue->not_empty, NULL);
-    pthread_cond_init(&queue->not_full, NULL);
+// ---------------------------------------------------------------------------
+// Shared helpers: hashing, growable buffers, intern and aggregate tables
+// ---------------------------------------------------------------------------
+
+uint64_t hash_bytes(const void* data, size_t len) {
+    const unsigned char* p = data;
+    uint64_t h = 1469598103934665603ULL;  // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
 }
 
-void check_termination_condition(WorkQueue* queue) {
-    int active = atomic_load(&queue->active_processes);
-    if (active == 0 && queue->count == 0) {
-        // If no active processes and queue is empty, terminate
-        printf("No active processes and empty queue. Initiating self-termination.\n");
-        kill(getpid(), SIGTERM);
+uint64_t hash_u64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+void* xrealloc(void* ptr, size_t size) {
+    void* p = realloc(ptr, size);
+    if (!p) {
+        perror("realloc");
+        exit(1);
     }
+    return p;
 }
 
-void queue_push(WorkQueue* queue, const char* path) {
-    pthread_mutex_lock(&queue->mutex);
-    
-    while (queue->count >= QUEUE_SIZE && running) {
-        pthread_cond_wait(&queue->not_full, &queue->mutex);
+// Syscalls issued by scan, side pool and output threads, counted per
+// thread without atomics and folded into the totals as each thread exits
+enum {
+    SC_OPEN, SC_CLOSE, SC_GETDENTS, SC_STAT, SC_XATTR, SC_READ, SC_SEEK,
+    SC_WRITE, SC_SYNC, SC_URING, SC_FUTEX, SC_KINDS
+};
+
+const char* syscall_names[SC_KINDS] = {
+    "open", "close", "getdents64", "stat", "xattr", "read", "lseek",
+    "write", "sync", "io_uring_enter", "futex"
+};
+
+typedef struct {
+    long calls[SC_KINDS];
+    long dirent_bytes;   // Returned by getdents64
+} SyscallCounts;
+
+__thread SyscallCounts thread_syscalls;
+atomic_long syscall_totals[SC_KINDS];
+atomic_long dirent_bytes_total;
+
+#define count_syscall(kind) (thread_syscalls.calls[kind]++)
+
+void syscalls_merge(void) {
+    for (int i = 0; i < SC_KINDS; i++) {
+        atomic_fetch_add_explicit(&syscall_totals[i], thread_syscalls.calls[i], memory_order_relaxed);
     }
-    
-    if (!running) {
-        pthread_mutex_unlock(&queue->mutex);
+    atomic_fetch_add_explicit(&dirent_bytes_total, thread_syscalls.dirent_bytes, memory_order_relaxed);
+    memset(&thread_syscalls, 0, sizeof(thread_syscalls));
+}
+
+atomic_long error_retries;    // Transient failures tried again
+
+int error_transient(int err) {
+    return err == EMFILE || err == ENFILE || err == ENOMEM || err == EINTR || err == EAGAIN;
+}
+
+// Decides whether to try again after a failure, sleeping with exponential
+// backoff for transient errnos so descriptors and memory can be freed by
+// other threads meanwhile. Preserves errno.
+int retry_transient(int* attempt) {
+    int err = errno;
+    if (!error_transient(err) || *attempt >= ERROR_RETRIES || !running) {
+        return 0;
+    }
+    atomic_fetch_add(&error_retries, 1);
+    if (err != EINTR) {
+        usleep(ERROR_BACKOFF_US << *attempt);
+    }
+    (*attempt)++;
+    errno = err;
+    return 1;
+}
+
+// Prints the totals after merging the calling thread's own counts
+void syscalls_report(long entries) {
+    syscalls_merge();
+    long total = 0;
+    for (int i = 0; i < SC_KINDS; i++) total += atomic_load(&syscall_totals[i]);
+    long getdents = atomic_load(&syscall_totals[SC_GETDENTS]);
+    printf("Syscalls: %ld for %ld entries (%.2f per entry), %.0f dirent bytes per getdents64\n",
+           total, entries, entries ? (double)total / (double)entries : 0.0,
+           getdents ? (double)atomic_load(&dirent_bytes_total) / (double)getdents : 0.0);
+    printf("Syscalls by type:");
+    for (int i = 0; i < SC_KINDS; i++) {
+        long n = atomic_load(&syscall_totals[i]);
+        if (n > 0) printf(" %s %ld", syscall_names[i], n);
+    }
+    printf("\n");
+}
+
+// Optional per-thread perf_event counters, attributed to the phase the
+// thread is in whenever it switches phases. Counters the kernel refuses
+// (no PMU, perf_event_paranoid) or the fd budget cannot spare are left out
+// and reported as n/a; CPU time then comes from the thread's clock.
+enum { PHASE_TRAVERSE, PHASE_METADATA, PHASE_FORMAT, PHASE_OUTPUT, PHASES };
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_LLC_MISSES, PERF_CTX_SWITCHES, PERF_TASK_CLOCK, PERF_COUNTERS };
+
+const char* phase_names[PHASES] = {"traversal", "metadata", "formatting", "output"};
+
+typedef struct {
+    int fds[PERF_COUNTERS];       // -1 when unavailable; fds[leader] reads the group
+    int leader;
+    int slot[PERF_COUNTERS];      // Position in the group read, -1 if not open
+    int nopen;
+    int phase;
+    uint64_t last[PERF_COUNTERS];
+    uint64_t totals[PHASES][PERF_COUNTERS];
+} PerfThread;
+
+int profiling;           // Open perf counters in every scan thread
+int perf_counters_max = PERF_COUNTERS;  // Per thread, lowered when fds are short
+__thread PerfThread* thread_perf;
+atomic_ullong perf_totals[PHASES][PERF_COUNTERS];
+atomic_int perf_opened[PERF_COUNTERS];  // Threads that got each counter
+atomic_int perf_threads;
+
+int perf_open(int type, uint64_t config, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_hv = 1;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0 && (errno == EACCES || errno == EPERM) && type == PERF_TYPE_HARDWARE) {
+        // User space only is still worth having for cycles and misses
+        attr.exclude_kernel = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+    }
+    return fd;
+}
+
+// Reads the group into values, indexed by counter
+void perf_sample(PerfThread* pt, uint64_t* values) {
+    if (pt->slot[PERF_TASK_CLOCK] < 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        values[PERF_TASK_CLOCK] = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    }
+    uint64_t buf[1 + PERF_COUNTERS];
+    if (pt->leader < 0 || read(pt->fds[pt->leader], buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t)) {
         return;
     }
-    
-    queue->rear = (queue->rear + 1) % QUEUE_SIZE;
-    strncpy(queue->paths[queue->rear], path, MAX_PATH_LENGTH - 1);
-    queue->paths[queue->rear][MAX_PATH_LENGTH - 1] = '\0';
-    queue->count++;
-    
-    pthread_cond_signal(&queue->not_empty);
-    pthread_mutex_unlock(&queue->mutex);
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (pt->slot[i] >= 0 && (uint64_t)pt->slot[i] < buf[0]) values[i] = buf[1 + pt->slot[i]];
+    }
 }
 
-int queue_pop(WorkQueue* queue, char* path) {
-    pthread_mutex_lock(&queue->mutex);
-    
-    queue->waiting_threads++;
-    
-    while (queue->count == 0 && running) {
-        check_termination_condition(queue);  // Check termination condition while waiting
-        pthread_cond_wait(&queue->not_empty, &queue->mutex);
+void perf_thread_start(void) {
+    if (!profiling) {
+        return;
     }
-    
-    queue->waiting_threads--;
-    
-    if (queue->count == 0) {
-        pthread_mutex_unlock(&queue->mutex);
-        return 0;
+    static const struct { int type; uint64_t config; } events[PERF_COUNTERS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    };
+    PerfThread* pt = calloc(1, sizeof(PerfThread));
+    pt->leader = -1;
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        pt->slot[i] = -1;
+        pt->fds[i] = pt->nopen < perf_counters_max
+                         ? perf_open(events[i].type, events[i].config,
+                                     pt->leader >= 0 ? pt->fds[pt->leader] : -1)
+                         : -1;
+        if (pt->fds[i] < 0) {
+            continue;
+        }
+        if (pt->leader < 0) pt->leader = i;
+        pt->slot[i] = pt->nopen++;
+        atomic_fetch_add(&perf_opened[i], 1);
     }
-    
-    strncpy(path, queue->paths[queue->front], MAX_PATH_LENGTH);
-    queue->front = (queue->front + 1) % QUEUE_SIZE;
-    queue->count--;
-    
-    pthread_cond_signal(&queue->not_full);
-    pthread_mutex_unlock(&queue->mutex);
-    return 1;
+    if (pt->slot[PERF_TASK_CLOCK] < 0) {
+        atomic_fetch_add(&perf_opened[PERF_TASK_CLOCK], 1);  // Timed with clock_gettime
+    }
+    atomic_fetch_add(&perf_threads, 1);
+    perf_sample(pt, pt->last);
+    thread_perf = pt;
 }
 
-void handle_signal(int signum) {
-    running = 0;
-    pthread_cond_broadcast(&work_queue.not_empty);
-    pthread_cond_broadcast(&work_queue.not_full);
+// Charges the counts since the last sample to the current phase
+void perf_charge(PerfThread* pt) {
+    uint64_t now[PERF_COUNTERS];
+    memcpy(now, pt->last, sizeof(now));
+    perf_sample(pt, now);
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        pt->totals[pt->phase][i] += now[i] - pt->last[i];
+    }
+    memcpy(pt->last, now, sizeof(now));
 }
 
-void process_file(const char* path) {
-    struct stat st;
-    if (lstat(path, &st) == -1) {
+// Moves the calling thread to phase; returns the phase left so nested work
+// can switch back. Free when profiling is off.
+int perf_phase(int phase) {
+    PerfThread* pt = thread_perf;
+    if (!pt || pt->phase == phase) {
+        return phase;
+    }
+    perf_charge(pt);
+    int prev = pt->phase;
+    pt->phase = phase;
+    return prev;
+}
+
+void perf_thread_stop(void) {
+    PerfThread* pt = thread_perf;
+    if (!pt) {
         return;
     }
-    
-    FileInfo info;
-    strncpy(info.path, path, MAX_PATH_LENGTH - 1);
-    info.path[MAX_PATH_LENGTH - 1] = '\0';
-    info.size = st.st_size;
-    info.mode = st.st_mode;
-    info.mtime = st.st_mtime;
-    
-    pthread_mutex_lock(&output_mutex);
-    fprintf(output_file, "Path: %s\n", info.path);
-    fprintf(output_file, "Size: %ld bytes\n", (long)info.size);
-    fprintf(output_file, "Type: %s\n", S_ISDIR(info.mode) ? "Directory" : 
-                                      S_ISREG(info.mode) ? "Regular File" :
-                                      S_ISLNK(info.mode) ? "Symbolic Link" : "Other");
-    fprintf(output_file, "Permissions: %o\n", info.mode & 0777);
-    fprintf(output_file, "Last Modified: %s", ctime(&info.mtime));
-    fprintf(output_file, "-------------------\n");
-    fflush(output_file);
-    pthread_mutex_unlock(&output_mutex);
+    perf_charge(pt);
+    for (int p = 0; p < PHASES; p++) {
+        for (int i = 0; i < PERF_COUNTERS; i++) {
+            atomic_fetch_add_explicit(&perf_totals[p][i], pt->totals[p][i], memory_order_relaxed);
+        }
+    }
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (pt->fds[i] >= 0) close(pt->fds[i]);
+    }
+    free(pt);
+    thread_perf = NULL;
 }
 
-void* worker_thread(void* arg) {
-    char path[MAX_PATH_LENGTH];
-    pthread_t thread_id = pthread_self();
-    printf("Thread ID: %lu started\n", (unsigned long)thread_id);
-    while (running) {
-        if (!queue_pop(&work_queue, path)) {
-            break;
+void perf_report(long entries) {
+    int threads = atomic_load(&perf_threads);
+    int have[PERF_COUNTERS];
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        have[i] = threads > 0 && atomic_load(&perf_opened[i]) == threads;
+    }
+    printf("Profile over %d scan threads:\n", threads);
+    printf("  %-10s %14s %14s %6s %12s %12s %10s %10s\n", "phase", "cycles", "instructions",
+           "IPC", "LLC misses", "misses/entry", "ctx sw", "cpu ms");
+    for (int p = 0; p < PHASES; p++) {
+        uint64_t v[PERF_COUNTERS];
+        for (int i = 0; i < PERF_COUNTERS; i++) v[i] = atomic_load(&perf_totals[p][i]);
+        char cols[PERF_COUNTERS + 2][32];
+        for (int i = 0; i < PERF_COUNTERS; i++) {
+            snprintf(cols[i], sizeof(cols[i]), have[i] ? "%llu" : "n/a", (unsigned long long)v[i]);
         }
-        
-        atomic_fetch_add(&work_queue.active_processes, 1);  // Increment active processes
-        
-        DIR* dir = opendir(path);
-        if (dir) {
-            struct dirent* entry;
-            while ((entry = readdir(dir)) != NULL && running) {
-                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                    continue;
-                }
-                
-                char full_path[MAX_PATH_LENGTH];
-                snprintf(full_path, MAX_PATH_LENGTH, "%s/%s", path, entry->d_name);
-                
-                struct stat st;
-                if (lstat(full_path, &st) == -1) {
-                    continue;
-                }
-                
-                process_file(full_path);
-                
-                if (S_ISDIR(st.st_mode)) {
-                    queue_push(&work_queue, full_path);
-                }
+        if (have[PERF_CYCLES] && have[PERF_INSTRUCTIONS] && v[PERF_CYCLES] > 0) {
+            snprintf(cols[PERF_COUNTERS], 32, "%.2f", (double)v[PERF_INSTRUCTIONS] / (double)v[PERF_CYCLES]);
+        } else {
+            strcpy(cols[PERF_COUNTERS], "n/a");
+        }
+        if (have[PERF_LLC_MISSES] && entries > 0) {
+            snprintf(cols[PERF_COUNTERS + 1], 32, "%.3f", (double)v[PERF_LLC_MISSES] / (double)entries);
+        } else {
+            strcpy(cols[PERF_COUNTERS + 1], "n/a");
+        }
+        if (have[PERF_TASK_CLOCK]) {
+            snprintf(cols[PERF_TASK_CLOCK], 32, "%.1f", (double)v[PERF_TASK_CLOCK] / 1e6);
+        }
+        printf("  %-10s %14s %14s %6s %12s %12s %10s %10s\n", phase_names[p],
+               cols[PERF_CYCLES], cols[PERF_INSTRUCTIONS], cols[PERF_COUNTERS],
+               cols[PERF_LLC_MISSES], cols[PERF_COUNTERS + 1], cols[PERF_CTX_SWITCHES],
+               cols[PERF_TASK_CLOCK]);
+    }
+    if (perf_counters_max < PERF_COUNTERS) {
+        printf("  Counters capped at %d per thread to leave directory fds under RLIMIT_NOFILE\n",
+               perf_counters_max);
+    } else if (!have[PERF_CYCLES] || !have[PERF_INSTRUCTIONS] || !have[PERF_LLC_MISSES]) {
+        printf("  Hardware counters unavailable: no PMU, or perf_event_paranoid forbids them\n");
+    }
+}
+
+// Timeline of scan thread activity, dumped as Chrome trace JSON. Each
+// thread appends spans to its own ring, so recording takes no locks; only
+// one directory visit in trace_every is timed, along with the output lock
+// waits inside it, to keep the clock reads off most entries.
+enum { TRACE_VISIT, TRACE_QUEUE_WAIT, TRACE_LOCK_WAIT, TRACE_RING_WAIT, TRACE_KINDS };
+
+const char* trace_names[TRACE_KINDS] = {"visit", "queue wait", "output lock wait", "io_uring wait"};
+
+typedef struct {
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    uint32_t entries;    // Entries recorded during a visit
+    uint8_t kind;
+    char name[35];       // Directory name, truncated
+} TraceEvent;
+
+typedef struct {
+    TraceEvent* events;  // TRACE_RING_EVENTS slots
+    uint64_t count;      // Spans recorded, including overwritten ones
+    long visits;         // Visits seen, for sampling
+    int sampled;         // The current visit is being timed
+    char pending[35];    // Name of the current visit
+} TraceBuffer;
+
+const char* trace_file;  // Set by -T
+int trace_every = 1;
+uint64_t trace_epoch;
+TraceBuffer trace_buffers[MAX_THREADS];
+__thread TraceBuffer* thread_trace;
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void trace_thread_start(int id) {
+    if (!trace_file) {
+        return;
+    }
+    TraceBuffer* tb = &trace_buffers[id];
+    if (!tb->events) {
+        tb->events = calloc(TRACE_RING_EVENTS, sizeof(TraceEvent));
+    }
+    thread_trace = tb->events ? tb : NULL;
+}
+
+void trace_thread_stop(void) {
+    thread_trace = NULL;
+}
+
+TraceEvent* trace_add(TraceBuffer* tb, int kind, uint64_t start) {
+    TraceEvent* ev = &tb->events[tb->count++ % TRACE_RING_EVENTS];
+    ev->start_ns = start;
+    ev->dur_ns = now_ns() - start;
+    ev->kind = (uint8_t)kind;
+    ev->entries = 0;
+    ev->name[0] = '\0';
+    return ev;
+}
+
+// Starts timing a visit to the named directory if it is sampled; returns
+// the start time, or 0 when it is not
+uint64_t trace_visit_begin(const char* name, size_t len) {
+    TraceBuffer* tb = thread_trace;
+    if (!tb || tb->visits++ % trace_every != 0) {
+        return 0;
+    }
+    if (len >= sizeof(tb->pending)) len = sizeof(tb->pending) - 1;
+    memcpy(tb->pending, name, len);
+    tb->pending[len] = '\0';
+    tb->sampled = 1;
+    return now_ns();
+}
+
+// Records the visit begun at start; a start of 0 drops it
+void trace_visit_end(uint64_t start, long entries) {
+    TraceBuffer* tb = thread_trace;
+    if (!tb) {
+        return;
+    }
+    tb->sampled = 0;
+    if (start) {
+        TraceEvent* ev = trace_add(tb, TRACE_VISIT, start);
+        ev->entries = (uint32_t)entries;
+        memcpy(ev->name, tb->pending, sizeof(ev->name));
+    }
+}
+
+// Runs of waiting are rare enough to record unsampled
+uint64_t trace_wait_begin(void) {
+    return thread_trace ? now_ns() : 0;
+}
+
+void trace_wait_end(uint64_t start, int kind) {
+    if (start && thread_trace) {
+        trace_add(thread_trace, kind, start);
+    }
+}
+
+// Scan metrics for the daemon's Prometheus endpoint and the error summary.
+// Each scan thread only writes its own slot, with relaxed loads and stores,
+// so the event loop can render them at any time without locks or
+// read-modify-write atomics.
+enum { OP_OPEN, OP_STAT, OP_READDIR, OP_XATTR, OP_READ, OP_SPILL, OPS };
+
+const char* op_names[OPS] = {"open", "stat", "getdents", "xattr", "read", "spill"};
+const double stat_bounds[STAT_BUCKETS] = {1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 1e-4, 1e-3, 1e-2};
+
+typedef struct {
+    atomic_long entries;
+    atomic_long stat_ns;                     // Sum of timed stat latencies
+    atomic_long stat_hist[STAT_BUCKETS + 1]; // Last bucket is past the largest bound
+    atomic_long errors[OPS][METRIC_ERRNOS];
+} ThreadMetrics;
+
+int metrics_enabled;     // Set when serve exposes metrics; enables stat timing
+ThreadMetrics thread_metrics_slots[METRIC_SLOTS];
+__thread ThreadMetrics* thread_metrics;
+atomic_int side_metrics_used;  // Slots past MAX_THREADS taken by side pool threads
+atomic_long scans_completed;
+atomic_int scan_in_progress;
+atomic_long last_scan_entries;
+atomic_long last_scan_ns;
+atomic_long errors_reported;  // Failures described on stderr
+
+void metric_add(atomic_long* counter, long n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+void metrics_thread_start(int id) {
+    thread_metrics = &thread_metrics_slots[id];
+}
+
+void metrics_error(int op, int err) {
+    ThreadMetrics* m = thread_metrics;
+    if (m) {
+        metric_add(&m->errors[op][err > 0 && err < METRIC_ERRNOS ? err : METRIC_ERRNOS - 1], 1);
+    }
+}
+
+// Stat latency is only timed when metrics are on
+uint64_t metrics_stat_begin(void) {
+    return metrics_enabled && thread_metrics ? now_ns() : 0;
+}
+
+void metrics_stat_end(uint64_t start) {
+    ThreadMetrics* m = thread_metrics;
+    if (!start || !m) {
+        return;
+    }
+    uint64_t ns = now_ns() - start;
+    int b = 0;
+    while (b < STAT_BUCKETS && (double)ns > stat_bounds[b] * 1e9) b++;
+    metric_add(&m->stat_hist[b], 1);
+    metric_add(&m->stat_ns, (long)ns);
+}
+
+long errors_total(int op, int err) {
+    long n = 0;
+    for (int t = 0; t < METRIC_SLOTS; t++) {
+        n += atomic_load_explicit(&thread_metrics_slots[t].errors[op][err], memory_order_relaxed);
+    }
+    return n;
+}
+
+void errors_report(void) {
+    long total = 0;
+    printf("Errors:");
+    for (int op = 0; op < OPS; op++) {
+        for (int e = 1; e < METRIC_ERRNOS; e++) {
+            long n = errors_total(op, e);
+            if (n == 0) {
+                continue;
             }
-            closedir(dir);
+            const char* name = e < METRIC_ERRNOS - 1 ? strerrorname_np(e) : NULL;
+            printf("%s %s %s %ld", total ? "," : "", op_names[op], name ? name : "other", n);
+            total += n;
         }
-        
-        atomic_fetch_sub(&work_queue.active_processes, 1);  // Decrement active processes
-        check_termination_condition(&work_queue);  // Check termination condition after processing
     }
-    
-    return NULL;
+    printf("%s (%ld total), transient retries: %ld\n", total ? "" : " none", total,
+           atomic_load(&error_retries));
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <directory> <output_file>\n", argv[0]);
-        return 1;
+// Token bucket that lets callers run into debt: each take is granted at
+// once and the caller then sleeps until the rate has paid for it, so
+// concurrent takers are spaced out without a queue
+typedef struct {
+    pthread_mutex_t mutex;
+    double rate;         // Tokens per second, 0 for no limit
+    double tokens;
+    uint64_t last_ns;
+    atomic_long wait_ns;
+} TokenBucket;
+
+TokenBucket metadata_bucket = {.mutex = PTHREAD_MUTEX_INITIALIZER};  // Opens, stats, getdents, xattrs
+TokenBucket read_bucket = {.mutex = PTHREAD_MUTEX_INITIALIZER};      // File content bytes
+__thread double metadata_credit;  // Ops already taken from metadata_bucket
+
+void bucket_take(TokenBucket* b, double n) {
+    pthread_mutex_lock(&b->mutex);
+    uint64_t now = now_ns();
+    if (b->last_ns) {
+        b->tokens += (double)(now - b->last_ns) * b->rate / 1e9;
+        if (b->tokens > b->rate * THROTTLE_BURST_MS / 1000) {
+            b->tokens = b->rate * THROTTLE_BURST_MS / 1000;
+        }
     }
-    
-    signal(SIGINT, handle_signal);
-    signal(SIGTERM, handle_signal);
-    
-    queue_init(&work_queue);
-    
-    output_file = fopen(argv[2], "w");
-    if (!output_file) {
-        perror("Failed to open output file");
-        return 1;
+    b->last_ns = now;
+    b->tokens -= n;
+    double debt = -b->tokens;
+    pthread_mutex_unlock(&b->mutex);
+    if (debt <= 0) {
+        return;
     }
-    
-    queue_push(&work_queue, argv[1]);
-    
-    for (int i = 0; i < MAX_THREADS; i++) {
-        if (pthread_create(&thread_pool[i], NULL, worker_thread, NULL) != 0) {
-            fprintf(stderr, "Failed to create thread %d\n", i);
-            running = 0;
+    uint64_t wait = (uint64_t)(debt / b->rate * 1e9);
+    atomic_fetch_add_explicit(&b->wait_ns, (long)wait, memory_order_relaxed);
+    while (wait > 0 && running) {
+        uint64_t slice = wait < THROTTLE_SLICE_MS * 1000000ULL ? wait : THROTTLE_SLICE_MS * 1000000ULL;
+        struct timespec ts = {(time_t)(slice / 1000000000), (long)(slice % 1000000000)};
+        nanosleep(&ts, NULL);
+        wait -= slice;
+    }
+}
+
+// Charges n metadata operations. Threads take about 1% of a second's
+// budget at a time so the bucket lock stays off the per-entry path.
+void throttle_metadata(int n) {
+    if (metadata_bucket.rate <= 0) {
+        return;
+    }
+    metadata_credit -= n;
+    if (metadata_credit < 0) {
+        double grain = metadata_bucket.rate / 100;
+        grain = grain < 1 ? 1 : grain > 64 ? 64 : grain;
+        bucket_take(&metadata_bucket, grain - metadata_credit);
+        metadata_credit = grain;
+    }
+}
+
+void throttle_read(size_t bytes) {
+    if (read_bucket.rate > 0) {
+        bucket_take(&read_bucket, (double)bytes);
+    }
+}
+
+// Parses a rate with an optional k, M or G suffix; 0 means no limit
+int parse_rate(const char* text, const char* end, double* rate) {
+    char* stop;
+    *rate = text == end ? 0 : strtod(text, &stop);
+    if (text == end) {
+        return 0;
+    }
+    if (stop < end && (*stop == 'k' || *stop == 'M' || *stop == 'G')) {
+        *rate *= *stop == 'k' ? 1e3 : *stop == 'M' ? 1e6 : 1e9;
+        stop++;
+    }
+    return stop == end && *rate >= 0 ? 0 : -1;
+}
+
+// Parses -R ops[:bytes], the metadata operations and content bytes per second
+int throttle_parse(const char* spec) {
+    const char* colon = strchr(spec, ':');
+    const char* ops_end = colon ? colon : spec + strlen(spec);
+    if (parse_rate(spec, ops_end, &metadata_bucket.rate) != 0 ||
+        (colon && parse_rate(colon + 1, colon + 1 + strlen(colon + 1), &read_bucket.rate) != 0)) {
+        fprintf(stderr, "Bad rate limit: %s (want ops[:bytes] per second)\n", spec);
+        return -1;
+    }
+    return 0;
+}
+
+void throttle_report(void) {
+    if (metadata_bucket.rate > 0) {
+        printf("Throttled: %.0f metadata ops/s, %.1f ms waited\n", metadata_bucket.rate,
+               (double)atomic_load(&metadata_bucket.wait_ns) / 1e6);
+    }
+    if (read_bucket.rate > 0) {
+        printf("Throttled: %.0f content bytes/s, %.1f ms waited\n", read_bucket.rate,
+               (double)atomic_load(&read_bucket.wait_ns) / 1e6);
+    }
+}
+
+// I/O priority and nice value per stage, applied by each thread as it
+// starts: ioprio_set and setpriority with the thread's own id only
+// affect that thread on Linux
+enum { STAGE_SCAN, STAGE_SIDE, STAGES };
+
+const char* stage_names[STAGES] = {"scan", "side"};
+
+typedef struct {
+    int ioprio;          // IOPRIO_PRIO_VALUE, 0 to leave it
+    int nice;
+    int set_nice;
+} StagePriority;
+
+StagePriority stage_priorities[STAGES];
+
+void stage_priority_apply(int stage) {
+    StagePriority* p = &stage_priorities[stage];
+    if (p->ioprio && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, p->ioprio) != 0) {
+        fprintf(stderr, "ioprio_set for %s threads: %s\n", stage_names[stage], strerror(errno));
+    }
+    if (p->set_nice && setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), p->nice) != 0) {
+        fprintf(stderr, "setpriority for %s threads: %s\n", stage_names[stage], strerror(errno));
+    }
+}
+
+// Parses -I stage=[class][:nice],... where class is idle, be0-be7 or rt0-rt7
+int stage_priority_parse(const char* spec) {
+    char* copy = strdup(spec);
+    char* save;
+    int err = *spec ? 0 : -1;
+    for (char* item = strtok_r(copy, ",", &save); item && !err; item = strtok_r(NULL, ",", &save)) {
+        char* eq = strchr(item, '=');
+        int stage = STAGES;
+        if (eq) {
+            *eq = '\0';
+            for (stage = 0; stage < STAGES && strcmp(item, stage_names[stage]) != 0; stage++) {}
+        }
+        if (stage == STAGES) {
+            err = -1;
             break;
         }
+        StagePriority* p = &stage_priorities[stage];
+        char* prio = eq + 1;
+        char* colon = strchr(prio, ':');
+        if (colon) {
+            *colon = '\0';
+            char* end;
+            p->nice = (int)strtol(colon + 1, &end, 10);
+            p->set_nice = 1;
+            if (end == colon + 1 || *end || p->nice < -20 || p->nice > 19) err = -1;
+        }
+        if (strcmp(prio, "idle") == 0) {
+            p->ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+        } else if ((strncmp(prio, "be", 2) == 0 || strncmp(prio, "rt", 2) == 0) &&
+                   prio[2] >= '0' && prio[2] <= '7' && !prio[3]) {
+            p->ioprio = IOPRIO_PRIO_VALUE(prio[0] == 'b' ? IOPRIO_CLASS_BE : IOPRIO_CLASS_RT,
+                                          prio[2] - '0');
+        } else if (*prio || !colon) {
+            err = -1;  // Unknown class, or neither a class nor a nice value
+        }
     }
-    
-    for (int i = 0; i < MAX_THREADS; i++) {
-        pthread_join(thread_pool[i], NULL);
+    free(copy);
+    if (err) {
+        fprintf(stderr, "Bad priority spec: %s (want scan|side=class[:nice] or scan|side=:nice, "
+                        "class idle|be0-7|rt0-7, nice -20..19)\n", spec);
     }
-    
-    fclose(output_file);
-    pthread_mutex_destroy(&output_mutex);
-    pthread_mutex_destroy(&work_queue.mutex);
-    pthread_cond_destroy(&work_queue.not_empty);
-    pthread_cond_destroy(&work_queue.not_full);
-    
+    return err;
+}
+
+ssize_t read_dirents(int fd, void* buf, size_t size) {
+    ssize_t n;
+    int attempt = 0;
+    do {
+        throttle_metadata(1);
+        n = getdents64(fd, buf, size);
+        count_syscall(SC_GETDENTS);
+    } while (n < 0 && retry_transient(&attempt));
+    if (n > 0) thread_syscalls.dirent_bytes += n;
+    return n;
+}
+
+// Names are escaped byte by byte; bytes past ASCII become \u00XX, which
+// keeps the file valid JSON even when truncation split a UTF-8 sequence
+void trace_write_name(FILE* f, const char* name) {
+    for (const unsigned char* p = (const unsigned char*)name; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(f, "\\%c", *p);
+        } else if (*p < 0x20 || *p >= 0x80) {
+            fprintf(f, "\\u%04x", *p);
+        } else {
+            fputc(*p, f);
+        }
+    }
+}
+
+int trace_write(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        perror("Failed to open trace file");
+        return -1;
+    }
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    const char* sep = "";
+    uint64_t spans = 0, lost = 0;
+    for (int t = 0; t < MAX_THREADS; t++) {
+        TraceBuffer* tb = &trace_buffers[t];
+        if (!tb->events) {
+            continue;
+        }
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                   "\"args\":{\"name\":\"scan %d\"}}", sep, t, t);
+        sep = ",\n";
+        uint64_t first = tb->count > TRACE_RING_EVENTS ? tb->count - TRACE_RING_EVENTS : 0;
+        for (uint64_t i = first; i < tb->count; i++) {
+            const TraceEvent* ev = &tb->events[i % TRACE_RING_EVENTS];
+            fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"scan\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                       "\"ts\":%.3f,\"dur\":%.3f",
+                    trace_names[ev->kind], t, (double)(ev->start_ns - trace_epoch) / 1e3,
+                    (double)ev->dur_ns / 1e3);
+            if (ev->kind == TRACE_VISIT) {
+                fprintf(f, ",\"args\":{\"dir\":\"");
+                trace_write_name(f, ev->name);
+                fprintf(f, "\",\"entries\":%u}", ev->entries);
+            }
+            fprintf(f, "}");
+        }
+        spans += tb->count - first;
+        lost += first;
+        free(tb->events);
+        tb->events = NULL;
+        tb->count = 0;
+        tb->visits = 0;
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f) != 0) {
+        perror("Failed to write trace file");
+        return -1;
+    }
+    printf("Trace: %llu spans written to %s, %llu older ones overwritten\n",
+           (unsigned long long)spans, path, (unsigned long long)lost);
+    return 0;
+}
+
+// String interning table: maps byte strings to dense ids
+typedef struct {
+    char** strs;
+    size_t* lens;
+    uint32_t* slots;  // id + 1, 0 = empty
+    size_t count;
+    size_t nslots;
+} StrTable;
+
+void strtab_grow(StrTable* t) {
+    size_t nslots = t->nslots ? t->nslots * 2 : 64;
+    uint32_t* slots = calloc(nslots, sizeof(uint32_t));
+    if (!slots) {
+        perror("calloc");
+        exit(1);
+    }
+    for (size_t id = 0; id < t->count; id++) {
+        size_t i = hash_bytes(t->strs[id], t->lens[id]) & (nslots - 1);
+        while (slots[i]) i = (i + 1) & (nslots - 1);
+        slots[i] = (uint32_t)id + 1;
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->nslots = nslots;
+    t->strs = xrealloc(t->strs, nslots / 2 * sizeof(char*));
+    t->lens = xrealloc(t->lens, nslots / 2 * sizeof(size_t));
+}
+
+uint32_t strtab_intern(StrTable* t, const char* s, size_t len) {
+    if (t->count + 1 > t->nslots / 2) {
+        strtab_grow(t);
+    }
+    size_t i = hash_bytes(s, len) & (t->nslots - 1);
+    while (t->slots[i]) {
+        uint32_t id = t->slots[i] - 1;
+        if (t->lens[id] == len && memcmp(t->strs[id], s, len) == 0) {
+            return id;
+        }
+        i = (i + 1) & (t->nslots - 1);
+    }
+    char* copy = malloc(len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    t->strs[t->count] = copy;
+    t->lens[t->count] = len;
+    t->slots[i] = (uint32_t)t->count + 1;
+    return (uint32_t)t->count++;
+}
+
+void strtab_free(StrTable* t) {
+    for (size_t i = 0; i < t->count; i++) free(t->strs[i]);
+    free(t->strs);
+    free(t->lens);
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
+
+// Open-addressing aggregate table keyed by group id
+typedef struct {
+    uint64_t* keys;
+    uint64_t* counts;
+    int64_t* bytes;
+    int64_t* allocated;  // Only filled by owner accounting
+    uint8_t* used;
+    size_t n;
+    size_t nslots;
+} GroupTable;
+
+void group_init(GroupTable* g, size_t nslots) {
+    g->nslots = nslots;
+    g->n = 0;
+    g->keys = calloc(nslots, sizeof(uint64_t));
+    g->counts = calloc(nslots, sizeof(uint64_t));
+    g->bytes = calloc(nslots, sizeof(int64_t));
+    g->allocated = calloc(nslots, sizeof(int64_t));
+    g->used = calloc(nslots, 1);
+}
+
+void group_free(GroupTable* g) {
+    free(g->keys);
+    free(g->counts);
+    free(g->bytes);
+    free(g->allocated);
+    free(g->used);
+}
+
+size_t group_slot(GroupTable* g, uint64_t key) {
+    if (g->n + 1 > g->nslots / 2) {
+        GroupTable bigger;
+        group_init(&bigger, g->nslots * 2);
+        for (size_t i = 0; i < g->nslots; i++) {
+            if (!g->used[i]) continue;
+            size_t j = group_slot(&bigger, g->keys[i]);
+            bigger.counts[j] = g->counts[i];
+            bigger.bytes[j] = g->bytes[i];
+            bigger.allocated[j] = g->allocated[i];
+        }
+        group_free(g);
+        *g = bigger;
+    }
+    size_t i = hash_u64(key) & (g->nslots - 1);
+    while (g->used[i] && g->keys[i] != key) i = (i + 1) & (g->nslots - 1);
+    if (!g->used[i]) {
+        g->used[i] = 1;
+        g->keys[i] = key;
+        g->n++;
+    }
+    return i;
+}
+
+const GroupTable* sort_table;  // qsort context for compare_group_slots
+int sort_by_key;
+
+int compare_group_slots(const void* a, const void* b) {
+    const GroupTable* g = sort_table;
+    size_t x = *(const size_t*)a, y = *(const size_t*)b;
+    if (sort_by_key) {
+        return (g->keys[x] > g->keys[y]) - (g->keys[x] < g->keys[y]);
+    }
+    return (g->bytes[y] > g->bytes[x]) - (g->bytes[y] < g->bytes[x]);
+}
+
+// Used slots of t, ordered by key or by byte total (largest first)
+size_t group_sorted_slots(const GroupTable* t, int by_key, size_t** out) {
+    size_t* order = malloc((t->n + 1) * sizeof(size_t));
+    size_t n = 0;
+    for (size_t i = 0; i < t->nslots; i++) {
+        if (t->used[i]) order[n++] = i;
+    }
+    sort_table = t;
+    sort_by_key = by_key;
+    qsort(order, n, sizeof(size_t), compare_group_slots);
+    *out = order;
+    return n;
+}
+
+// ---------------------------------------------------------------------------
+// Scan engine
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    int id;
+    uint32_t top_id;     // Top-level directory of the entries being processed
+    DirNode* dir;        // Directory of the entry being processed
+    int dir_fd;          // Its listing fd, for calls relative to it
+    const char* name;    // The entry's name in dir
+    GroupTable users;    // uid -> entries, bytes
+    GroupTable groups;   // gid -> entries, bytes
+    GroupTable tops;     // top_id << 32 | uid -> entries, bytes
+    int64_t apparent_bytes;
+    int64_t allocated_bytes;
+    long sparse_files;
+    char* xattr_names;   // Attribute name list
+    size_t xattr_names_cap;
+    char* xattr_value;   // Raw value being read
+    size_t xattr_value_cap;
+    char* xattr_text;    // Rendered "name\0value\0" pairs for the current entry
+    size_t xattr_text_len;
+    size_t xattr_text_cap;
+    uint32_t* xattr_ids;
+    size_t xattr_ids_cap;
+    long dangling_links;
+    long entries;        // Entries recorded
+    char* path;          // Path of the entry being processed, any length
+    size_t path_cap;
+    char* dirents;       // getdents64 buffer
+    DirNode* children[PUSH_BATCH];  // Subdirectories awaiting one batched push
+    int nchildren;
+} WorkerState;
+
+// One stripe of the (dev, ino) set of directories already queued when
+// following symlinks. Stripes sit on separate cache lines so threads
+// hitting different stripes never share a line.
+typedef struct {
+    pthread_mutex_t mutex;
+    dev_t* devs;
+    ino_t* inos;
+    uint8_t* used;
+    size_t n;
+    size_t nslots;
+} __attribute__((aligned(64))) VisitedShard;
+
+// Bounded queue of paths drained by a few side threads, for per-file work
+// that must not slow down the directory walk. A full pool either drops the
+// item or, if blocking, makes the submitter wait for a free slot.
+typedef struct {
+    char* path;
+    uint32_t shard;      // Output shard key of the entry's record
+    DirNode* dir;        // Held directory, so the entry opens relative to its fd
+} SideItem;
+
+typedef struct {
+    SideItem* items;
+    int capacity;
+    int front;
+    int count;
+    int closing;
+    int blocking;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_t threads[SIDE_POOL_MAX_THREADS];
+    int nthreads;
+    void (*handle)(const SideItem* item);
+    void (*release)(DirNode* dir);  // Drops the hold on item->dir
+    atomic_long dropped;
+} SidePool;
+
+// Minimal io_uring over the raw syscalls
+typedef struct {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    unsigned cq_entries;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    unsigned sq_local;   // Tail including SQEs not yet published
+    unsigned queued;     // SQEs written but not yet consumed by the kernel
+    unsigned inflight;   // Submitted without a completion
+    void* sq_map;
+    size_t sq_map_len;
+    void* cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+} Uring;
+
+void uring_destroy(Uring* ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map && ring->cq_map != MAP_FAILED) munmap(ring->cq_map, ring->cq_map_len);
+    if (ring->sq_map && ring->sq_map != MAP_FAILED) munmap(ring->sq_map, ring->sq_map_len);
+    if (ring->fd >= 0) close(ring->fd);
+    ring->fd = -1;
+}
+
+// Returns -1 where io_uring is missing or forbidden
+int uring_init(Uring* ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = (int)syscall(SYS_io_uring_setup, entries, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        uring_destroy(ring);
+        return -1;
+    }
+    char* sq = ring->sq_map;
+    char* cq = ring->cq_map;
+    ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cq_entries = p.cq_entries;
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    ring->sq_local = *ring->sq_tail;
+    return 0;
+}
+
+// Returns a zeroed SQE, or NULL while the SQ is full or the CQ could overflow
+struct io_uring_sqe* uring_get_sqe(Uring* ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local - head == ring->sq_entries || ring->inflight + ring->queued >= ring->cq_entries) {
+        return NULL;
+    }
+    unsigned index = ring->sq_local++ & ring->sq_mask;
+    ring->sq_array[index] = index;
+    ring->queued++;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Publishes queued SQEs and optionally waits for one completion
+int uring_submit(Uring* ring, int wait) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    int ret = (int)syscall(SYS_io_uring_enter, ring->fd, ring->queued, wait ? 1 : 0, flags, NULL, 0);
+    count_syscall(SC_URING);
+    if (ret < 0) {
+        return errno == EINTR || errno == EAGAIN || errno == EBUSY ? 0 : -1;
+    }
+    ring->queued -= (unsigned)ret;
+    ring->inflight += (unsigned)ret;
+    return 0;
+}
+
+enum { WRITER_DIRECT, WRITER_DONTNEED, WRITER_PLAIN };
+
+// Output file written in whole OUTPUT_BLOCK_SIZE blocks that bypass or are
+// dropped from the page cache, which is better spent on directory metadata.
+// With io_uring, a full block is submitted as a fixed-buffer write and
+// formatting continues in the other buffer while it is in flight.
+typedef struct {
+    int fd;
+    int mode;            // WRITER_DIRECT, WRITER_DONTNEED or WRITER_PLAIN
+    char* buf;           // Block being filled, OUTPUT_ALIGN aligned
+    size_t len;
+    off_t offset;        // Bytes handed to the kernel
+    off_t prev_offset;   // Block still being written back, WRITER_DONTNEED
+    char* scratch;       // Formatting space for text that spans blocks
+    size_t scratch_cap;
+    int error;           // First write errno
+    Uring ring;
+    int use_ring;
+    char* bufs[OUTPUT_BUFFERS];
+    int cur;             // Index of buf in bufs
+    int busy[OUTPUT_BUFFERS];
+    off_t busy_offset[OUTPUT_BUFFERS];
+    size_t busy_len[OUTPUT_BUFFERS];
+    long async_blocks;   // Blocks written through the ring
+    long stalls;         // Times a full block found the other still in flight
+    int64_t stall_ns;
+} BlockWriter;
+
+// One output file and the xattr strings already defined in it, so every
+// shard can be read on its own. Without -S the output file is the only
+// shard; with it the output file becomes a manifest of <output>.<i> files.
+typedef struct {
+    BlockWriter writer;
+    char* path;
+    pthread_mutex_t mutex;
+    StrTable dict;
+    long records;
+} OutputShard;
+
+WorkerState workers[MAX_THREADS];
+int accounting;          // Collect per-owner usage during the scan
+const char* scan_root;
+SidePool* probe_pool;    // Extent probing of large regular files, if enabled
+SidePool* content_pool;  // Magic byte classification of regular files, if enabled
+off_t probe_min_size;
+int collect_xattrs;      // Read extended attributes and ACLs per entry
+int follow_links;        // Descend into symlinked directories
+FdBudget fd_budget = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+int queue_window;        // Bounded memory mode: queued directories kept in memory
+int async_engine;        // Walk with io_uring driven visits instead of worker threads
+VisitedShard visited[VISITED_SHARDS];
+OutputShard* output_shards;
+int output_shard_count;
+int shard_by_top;        // Place records by top-level directory, not by worker
+StrTable top_names;      // Names of the root's immediate children
+pthread_mutex_t top_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+uint32_t top_intern(const char* name, size_t len) {
+    pthread_mutex_lock(&top_mutex);
+    uint32_t id = strtab_intern(&top_names, name, len);
+    pthread_mutex_unlock(&top_mutex);
+    return id;
+}
+
+OutputShard* output_shard(uint32_t key) {
+    return &output_shards[key % (uint32_t)output_shard_count];
+}
+
+uint32_t shard_key(const WorkerState* ws) {
+    return shard_by_top ? ws->top_id : (uint32_t)ws->id;
+}
+
+// Takes the shard lock, recording the wait in the trace only when the lock
+// is contended during a sampled visit
+void shard_lock(OutputShard* out) {
+    if (pthread_mutex_trylock(&out->mutex) == 0) {
+        return;
+    }
+    TraceBuffer* tb = thread_trace;
+    uint64_t start = tb && tb->sampled ? now_ns() : 0;
+    pthread_mutex_lock(&out->mutex);
+    trace_wait_end(start, TRACE_LOCK_WAIT);
+}
+
+// Sets up async writes: both blocks registered as fixed buffers, the fd as
+// a fixed file. Any failure leaves the writer synchronous.
+void writer_ring_init(BlockWriter* w) {
+    if (uring_init(&w->ring, 4) != 0) {
+        return;
+    }
+    if (posix_memalign((void**)&w->bufs[1], OUTPUT_ALIGN, OUTPUT_BLOCK_SIZE) != 0) {
+        w->bufs[1] = NULL;
+        uring_destroy(&w->ring);
+        return;
+    }
+    struct iovec iov[OUTPUT_BUFFERS];
+    for (int i = 0; i < OUTPUT_BUFFERS; i++) {
+        iov[i].iov_base = w->bufs[i];
+        iov[i].iov_len = OUTPUT_BLOCK_SIZE;
+    }
+    if (syscall(SYS_io_uring_register, w->ring.fd, IORING_REGISTER_BUFFERS, iov, OUTPUT_BUFFERS) != 0 ||
+        syscall(SYS_io_uring_register, w->ring.fd, IORING_REGISTER_FILES, &w->fd, 1) != 0) {
+        uring_destroy(&w->ring);
+        free(w->bufs[1]);
+        w->bufs[1] = NULL;
+        return;
+    }
+    w->use_ring = 1;
+}
+
+// Opens path for block writes, preferring O_DIRECT where the filesystem
+// allows it and plain writes for pipes and other non-regular files. "-" is
+// a duplicate of stdout, written with plain whole-block writes wherever it
+// points; a pipe is grown to hold a full block so each write moves one.
+int writer_open(BlockWriter* w, const char* path) {
+    memset(w, 0, sizeof(*w));
+    struct stat st;
+    if (strcmp(path, "-") == 0) {
+        w->mode = WRITER_PLAIN;
+        w->fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+        if (w->fd >= 0 && fstat(w->fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+            fcntl(w->fd, F_SETPIPE_SZ, OUTPUT_BLOCK_SIZE);
+        }
+    } else {
+        w->mode = WRITER_DIRECT;
+        w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+        if (w->fd < 0 && errno == EINVAL) {
+            w->mode = WRITER_DONTNEED;
+            w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        }
+        if (w->fd >= 0 && fstat(w->fd, &st) == 0 && !S_ISREG(st.st_mode)) {
+            fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+            w->mode = WRITER_PLAIN;
+        }
+    }
+    if (w->fd < 0) {
+        return -1;
+    }
+    if (posix_memalign((void**)&w->bufs[0], OUTPUT_ALIGN, OUTPUT_BLOCK_SIZE) != 0) {
+        close(w->fd);
+        return -1;
+    }
+    w->buf = w->bufs[0];
+    if (w->mode != WRITER_PLAIN) {
+        writer_ring_init(w);
+    }
+    return 0;
+}
+
+int writer_write_fully(BlockWriter* w, const char* data, size_t len) {
+    while (len > 0) {
+        // Ring writes do not move the file position, so seekable files
+        // are always written at an explicit offset
+        ssize_t n = w->mode == WRITER_PLAIN ? write(w->fd, data, len)
+                                            : pwrite(w->fd, data, len, w->offset);
+        count_syscall(SC_WRITE);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL && w->mode == WRITER_DIRECT) {
+                // The filesystem accepted O_DIRECT at open but not the write
+                fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+                w->mode = WRITER_DONTNEED;
+                continue;
+            }
+            if (!w->error) w->error = errno;
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+        w->offset += n;
+    }
+    return 0;
+}
+
+// Collects write completions, waiting for one if wait is set. Short writes
+// and an O_DIRECT refusal are finished synchronously.
+void writer_reap(BlockWriter* w, int wait) {
+    if (uring_submit(&w->ring, wait) != 0 && !w->error) {
+        w->error = errno;
+    }
+    Uring* ring = &w->ring;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+        int b = (int)cqe->user_data;
+        size_t done = cqe->res > 0 ? (size_t)cqe->res : 0;
+        if (cqe->res == -EINVAL && w->mode == WRITER_DIRECT) {
+            fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+            w->mode = WRITER_DONTNEED;
+        } else if (cqe->res < 0 && !w->error) {
+            w->error = -cqe->res;
+        }
+        const char* rest = w->bufs[b] + done;
+        size_t left = w->busy_len[b] - done;
+        off_t at = w->busy_offset[b] + (off_t)done;
+        while (left > 0 && !w->error) {
+            ssize_t n = pwrite(w->fd, rest, left, at);
+            count_syscall(SC_WRITE);
+            if (n < 0) {
+                if (errno != EINTR) w->error = errno;
+                continue;
+            }
+            rest += n;
+            left -= (size_t)n;
+            at += n;
+        }
+        w->busy[b] = 0;
+        ring->inflight--;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+void writer_wait_idle(BlockWriter* w) {
+    while ((w->ring.inflight > 0 || w->ring.queued > 0) && !w->error) {
+        writer_reap(w, 1);
+    }
+}
+
+// In WRITER_DONTNEED mode the block written at start begins writeback at
+// once; the one before it is waited for and dropped, so at most two blocks
+// of output sit in the page cache. A block still on the ring starts its
+// writeback when the next one waits for it.
+void writer_dontneed(BlockWriter* w, off_t start) {
+    if (w->mode != WRITER_DONTNEED) {
+        return;
+    }
+    if (!w->use_ring) {
+        sync_file_range(w->fd, start, w->offset - start, SYNC_FILE_RANGE_WRITE);
+        count_syscall(SC_SYNC);
+    }
+    if (start > w->prev_offset) {
+        sync_file_range(w->fd, w->prev_offset, start - w->prev_offset,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(w->fd, w->prev_offset, start - w->prev_offset, POSIX_FADV_DONTNEED);
+        thread_syscalls.calls[SC_SYNC] += 2;
+    }
+    w->prev_offset = start;
+}
+
+// Writes out the buffered block: a full block goes to the ring when there
+// is one, anything else is written synchronously once the ring is idle
+void writer_flush(BlockWriter* w) {
+    off_t start = w->offset;
+    if (w->use_ring && w->len == OUTPUT_BLOCK_SIZE && !w->error) {
+        struct io_uring_sqe* sqe = uring_get_sqe(&w->ring);
+        if (sqe) {
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->fd = 0;
+            sqe->addr = (uint64_t)(uintptr_t)w->buf;
+            sqe->len = (unsigned)w->len;
+            sqe->off = (uint64_t)start;
+            sqe->buf_index = (uint16_t)w->cur;
+            sqe->user_data = (uint64_t)w->cur;
+            w->busy[w->cur] = 1;
+            w->busy_offset[w->cur] = start;
+            w->busy_len[w->cur] = w->len;
+            w->offset += (off_t)w->len;
+            w->async_blocks++;
+            writer_reap(w, 0);
+
+            // Back-pressure: the next buffer is still being written
+            w->cur = (w->cur + 1) % OUTPUT_BUFFERS;
+            if (w->busy[w->cur]) {
+                struct timespec a, b;
+                clock_gettime(CLOCK_MONOTONIC, &a);
+                while (w->busy[w->cur] && !w->error) writer_reap(w, 1);
+                clock_gettime(CLOCK_MONOTONIC, &b);
+                w->stalls++;
+                w->stall_ns += (int64_t)(b.tv_sec - a.tv_sec) * 1000000000 + (b.tv_nsec - a.tv_nsec);
+            }
+            w->buf = w->bufs[w->cur];
+            w->len = 0;
+            writer_dontneed(w, start);
+            return;
+        }
+    }
+    if (w->use_ring) {
+        writer_wait_idle(w);
+    }
+    if (w->len == 0 || writer_write_fully(w, w->buf, w->len) != 0) {
+        w->len = 0;
+        return;
+    }
+    writer_dontneed(w, start);
+    w->len = 0;
+}
+
+void writer_append(BlockWriter* w, const char* data, size_t len) {
+    while (len > 0) {
+        size_t room = OUTPUT_BLOCK_SIZE - w->len;
+        size_t n = len < room ? len : room;
+        memcpy(w->buf + w->len, data, n);
+        w->len += n;
+        data += n;
+        len -= n;
+        if (w->len == OUTPUT_BLOCK_SIZE) {
+            int phase = perf_phase(PHASE_OUTPUT);
+            writer_flush(w);
+            perf_phase(phase);
+        }
+    }
+}
+
+// Formats straight into the block, or via scratch when the text does not fit
+void writer_printf(BlockWriter* w, const char* fmt, ...) {
+    va_list ap;
+    size_t room = OUTPUT_BLOCK_SIZE - w->len;
+    va_start(ap, fmt);
+    int n = vsnprintf(w->buf + w->len, room, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    if ((size_t)n < room) {
+        w->len += (size_t)n;
+        return;
+    }
+    if ((size_t)n + 1 > w->scratch_cap) {
+        w->scratch_cap = (size_t)n + 1;
+        w->scratch = xrealloc(w->scratch, w->scratch_cap);
+    }
+    va_start(ap, fmt);
+    vsnprintf(w->scratch, w->scratch_cap, fmt, ap);
+    va_end(ap);
+    writer_append(w, w->scratch, (size_t)n);
+}
+
+// Writes the partial last block without O_DIRECT, whose length rules it
+// cannot meet, then drops the file from the page cache
+int writer_close(BlockWriter* w) {
+    if (w->mode == WRITER_DIRECT && w->len % OUTPUT_ALIGN != 0) {
+        fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+    }
+    writer_flush(w);
+    if (w->use_ring) {
+        writer_wait_idle(w);
+        uring_destroy(&w->ring);
+        atomic_fetch_add(&output_async_blocks, w->async_blocks);
+        atomic_fetch_add(&output_stalls, w->stalls);
+        atomic_fetch_add(&output_stall_ns, w->stall_ns);
+    }
+    if (w->mode != WRITER_PLAIN && !w->error) {
+        fdatasync(w->fd);
+        posix_fadvise(w->fd, 0, 0, POSIX_FADV_DONTNEED);
+        thread_syscalls.calls[SC_SYNC] += 2;
+    }
+    int err = w->error;
+    if (close(w->fd) != 0 && !err) err = errno;
+    for (int i = 0; i < OUTPUT_BUFFERS; i++) free(w->bufs[i]);
+    free(w->scratch);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int error_records;       // Write an Error record for each failure (-e)
+
+// Counts a failed operation on path, describes the first few on stderr
+// and, with -e, records it in the given shard so the output shows what it
+// is missing
+void shard_error(uint32_t shard, const char* path, int op, int err) {
+    metrics_error(op, err);
+    if (atomic_fetch_add(&errors_reported, 1) < ERROR_REPORT_LIMIT) {
+        fprintf(stderr, "%s %s: %s\n", op_names[op], path, strerror(err));
+    }
+    if (!error_records || !output_shards) {
+        return;
+    }
+    const char* name = strerrorname_np(err);
+    OutputShard* out = output_shard(shard);
+    shard_lock(out);
+    writer_printf(&out->writer, "Path: %s\n", path);
+    if (name) {
+        writer_printf(&out->writer, "Error: %s %s\n", op_names[op], name);
+    } else {
+        writer_printf(&out->writer, "Error: %s %d\n", op_names[op], err);
+    }
+    writer_printf(&out->writer, "-------------------\n");
+    out->records++;
+    pthread_mutex_unlock(&out->mutex);
+}
+
+void scan_error(WorkerState* ws, const char* path, int op, int err) {
+    shard_error(shard_key(ws), path, op, err);
+}
+
+// Opens the shards of a scan written to filename. With one shard that is
+// filename itself; with more, filename is the manifest.
+int output_open(const char* filename, int nshards) {
+    if (nshards > 1) {
+        output_file = fopen(filename, "w");
+        if (!output_file) {
+            perror("Failed to open output file");
+            return -1;
+        }
+    }
+    output_shards = calloc((size_t)nshards, sizeof(OutputShard));
+    output_shard_count = nshards;
+    for (int i = 0; i < nshards; i++) {
+        OutputShard* shard = &output_shards[i];
+        pthread_mutex_init(&shard->mutex, NULL);
+        shard->path = malloc(strlen(filename) + 16);
+        if (nshards == 1) {
+            strcpy(shard->path, filename);
+        } else {
+            sprintf(shard->path, "%s.%d", filename, i);
+        }
+        if (writer_open(&shard->writer, shard->path) != 0) {
+            perror(shard->path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Closes the shards and, when sharding, writes the manifest: one block per
+// shard naming its file relative to the manifest, with its record count
+int output_close(void) {
+    int err = 0;
+    if (output_shard_count > 1) {
+        fprintf(output_file, "Manifest: %d shards by %s\n", output_shard_count,
+                shard_by_top ? "top-level directory" : "worker");
+    }
+    for (int i = 0; i < output_shard_count; i++) {
+        OutputShard* shard = &output_shards[i];
+        off_t bytes = shard->writer.offset + (off_t)shard->writer.len;
+        if (writer_close(&shard->writer) != 0) {
+            perror(shard->path);
+            err = -1;
+        }
+        if (output_file) {
+            const char* slash = strrchr(shard->path, '/');
+            fprintf(output_file, "Shard: %s\n", slash ? slash + 1 : shard->path);
+            fprintf(output_file, "Records: %ld\n", shard->records);
+            fprintf(output_file, "Bytes: %lld\n", (long long)bytes);
+            fprintf(output_file, "-------------------\n");
+        }
+        strtab_free(&shard->dict);
+        free(shard->path);
+        pthread_mutex_destroy(&shard->mutex);
+    }
+    if (output_file && fclose(output_file) != 0) err = -1;
+    free(output_shards);
+    output_shards = NULL;
+    output_shard_count = 0;
+    output_file = NULL;
+    return err;
+}
+
+void usage_add(WorkerState* ws, const struct stat* st) {
+    int64_t allocated = (int64_t)st->st_blocks * 512;
+    size_t slot = group_slot(&ws->users, st->st_uid);
+    ws->users.counts[slot]++;
+    ws->users.bytes[slot] += st->st_size;
+    ws->users.allocated[slot] += allocated;
+    slot = group_slot(&ws->groups, st->st_gid);
+    ws->groups.counts[slot]++;
+    ws->groups.bytes[slot] += st->st_size;
+    ws->groups.allocated[slot] += allocated;
+    slot = group_slot(&ws->tops, (uint64_t)ws->top_id << 32 | st->st_uid);
+    ws->tops.counts[slot]++;
+    ws->tops.bytes[slot] += st->st_size;
+    ws->tops.allocated[slot] += allocated;
+}
+
+void* side_pool_thread(void* arg) {
+    SidePool* pool = arg;
+    stage_priority_apply(STAGE_SIDE);
+    int slot = MAX_THREADS + atomic_fetch_add(&side_metrics_used, 1);
+    if (slot < METRIC_SLOTS) {
+        metrics_thread_start(slot);
+    }
+    for (;;) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->count == 0 && !pool->closing) {
+            pthread_cond_wait(&pool->not_empty, &pool->mutex);
+        }
+        if (pool->count == 0) {
+            pthread_mutex_unlock(&pool->mutex);
+            syscalls_merge();
+            return NULL;
+        }
+        SideItem item = pool->items[pool->front];
+        pool->front = (pool->front + 1) % pool->capacity;
+        pool->count--;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (running) pool->handle(&item);
+        pool->release(item.dir);
+        free(item.path);
+    }
+}
+
+void side_pool_start(SidePool* pool, int nthreads, int capacity, int blocking,
+                     void (*handle)(const SideItem*), void (*release)(DirNode*)) {
+    pool->items = malloc((size_t)capacity * sizeof(SideItem));
+    pool->capacity = capacity;
+    pool->front = 0;
+    pool->count = 0;
+    pool->closing = 0;
+    pool->blocking = blocking;
+    pool->handle = handle;
+    pool->release = release;
+    pool->nthreads = 0;
+    atomic_init(&pool->dropped, 0);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+    for (int i = 0; i < nthreads && i < SIDE_POOL_MAX_THREADS; i++) {
+        if (pthread_create(&pool->threads[i], NULL, side_pool_thread, pool) != 0) break;
+        pool->nthreads++;
+    }
+}
+
+// Takes over the caller's hold on dir. Returns 0 if the item was dropped
+// because the pool is saturated.
+int side_pool_submit(SidePool* pool, const char* path, uint32_t shard, DirNode* dir) {
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->blocking && pool->count == pool->capacity && pool->nthreads > 0 && running) {
+        pthread_cond_wait(&pool->not_full, &pool->mutex);
+    }
+    if (pool->count == pool->capacity || pool->nthreads == 0) {
+        pthread_mutex_unlock(&pool->mutex);
+        pool->release(dir);
+        atomic_fetch_add(&pool->dropped, 1);
+        return 0;
+    }
+    SideItem* item = &pool->items[(pool->front + pool->count) % pool->capacity];
+    item->path = strdup(path);
+    item->shard = shard;
+    item->dir = dir;
+    pool->count++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->mutex);
+    return 1;
+}
+
+// Drains queued items, then joins the threads
+void side_pool_stop(SidePool* pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->closing = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    for (int i = 0; i < pool->count; i++) {
+        SideItem* item = &pool->items[(pool->front + i) % pool->capacity];
+        pool->release(item->dir);
+        free(item->path);
+    }
+    free(pool->items);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_cond_destroy(&pool->not_full);
+}
+
+// Content signatures, compiled at startup into per-first-byte candidate lists
+typedef struct {
+    const char* label;
+    int offset;
+    const char* magic;
+    int len;
+    int offset2;          // Optional second pattern, e.g. the RIFF subtype
+    const char* magic2;
+    int len2;
+} Signature;
+
+const Signature signatures[] = {
+    {"ELF", 0, "\x7f" "ELF", 4, 0, NULL, 0},
+    {"gzip", 0, "\x1f\x8b", 2, 0, NULL, 0},
+    {"bzip2", 0, "BZh", 3, 0, NULL, 0},
+    {"xz", 0, "\xfd" "7zXZ\0", 6, 0, NULL, 0},
+    {"zstd", 0, "\x28\xb5\x2f\xfd", 4, 0, NULL, 0},
+    {"7z", 0, "7z\xbc\xaf\x27\x1c", 6, 0, NULL, 0},
+    {"zip", 0, "PK\x03\x04", 4, 0, NULL, 0},
+    {"zip", 0, "PK\x05\x06", 4, 0, NULL, 0},
+    {"PDF", 0, "%PDF-", 5, 0, NULL, 0},
+    {"PNG", 0, "\x89PNG\r\n\x1a\n", 8, 0, NULL, 0},
+    {"JPEG", 0, "\xff\xd8\xff", 3, 0, NULL, 0},
+    {"GIF", 0, "GIF87a", 6, 0, NULL, 0},
+    {"GIF", 0, "GIF89a", 6, 0, NULL, 0},
+    {"TIFF", 0, "II*\0", 4, 0, NULL, 0},
+    {"TIFF", 0, "MM\0*", 4, 0, NULL, 0},
+    {"WebP", 0, "RIFF", 4, 8, "WEBP", 4},
+    {"WAV", 0, "RIFF", 4, 8, "WAVE", 4},
+    {"AVI", 0, "RIFF", 4, 8, "AVI ", 4},
+    {"MP4", 4, "ftyp", 4, 0, NULL, 0},
+    {"MP3", 0, "ID3", 3, 0, NULL, 0},
+    {"Ogg", 0, "OggS", 4, 0, NULL, 0},
+    {"FLAC", 0, "fLaC", 4, 0, NULL, 0},
+    {"SQLite", 0, "SQLite format 3\0", 16, 0, NULL, 0},
+    {"Java class", 0, "\xca\xfe\xba\xbe", 4, 0, NULL, 0},
+    {"WebAssembly", 0, "\0asm", 4, 0, NULL, 0},
+    {"PE", 0, "MZ", 2, 0, NULL, 0},
+    {"tar", 257, "ustar", 5, 0, NULL, 0},
+    {"script", 0, "#!", 2, 0, NULL, 0},
+};
+#define SIGNATURE_COUNT (int)(sizeof(signatures) / sizeof(signatures[0]))
+
+// Candidates keyed by the byte at each signature's own offset, longest first,
+// so a file is matched with one table lookup per distinct offset
+typedef struct {
+    int offset;
+    int16_t* first[256];      // -1 terminated signature indexes
+} SignatureTable;
+
+SignatureTable signature_tables[4];
+int signature_table_count;
+
+int compare_signature_length(const void* a, const void* b) {
+    const Signature* x = &signatures[*(const int16_t*)a];
+    const Signature* y = &signatures[*(const int16_t*)b];
+    return (y->len + y->len2) - (x->len + x->len2);
+}
+
+void compile_signatures(void) {
+    for (int i = 0; i < SIGNATURE_COUNT; i++) {
+        SignatureTable* t = NULL;
+        for (int j = 0; j < signature_table_count; j++) {
+            if (signature_tables[j].offset == signatures[i].offset) t = &signature_tables[j];
+        }
+        if (!t) {
+            t = &signature_tables[signature_table_count++];
+            t->offset = signatures[i].offset;
+        }
+        unsigned char b = (unsigned char)signatures[i].magic[0];
+        int n = 0;
+        while (t->first[b] && t->first[b][n] >= 0) n++;
+        t->first[b] = xrealloc(t->first[b], (size_t)(n + 2) * sizeof(int16_t));
+        t->first[b][n] = (int16_t)i;
+        t->first[b][n + 1] = -1;
+        qsort(t->first[b], (size_t)n + 1, sizeof(int16_t), compare_signature_length);
+    }
+}
+
+const char* classify_content(const unsigned char* buf, size_t len) {
+    if (len == 0) {
+        return "empty";
+    }
+    for (int t = 0; t < signature_table_count; t++) {
+        const SignatureTable* table = &signature_tables[t];
+        if ((size_t)table->offset >= len) continue;
+        const int16_t* cand = table->first[buf[table->offset]];
+        for (; cand && *cand >= 0; cand++) {
+            const Signature* sig = &signatures[*cand];
+            if ((size_t)(sig->offset + sig->len) > len ||
+                memcmp(buf + sig->offset, sig->magic, (size_t)sig->len) != 0) continue;
+            if (sig->magic2 && ((size_t)(sig->offset2 + sig->len2) > len ||
+                memcmp(buf + sig->offset2, sig->magic2, (size_t)sig->len2) != 0)) continue;
+            return sig->label;
+        }
+    }
+    // No signature: call it text if the sample has no NULs or control bytes
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == 0 || (buf[i] < 0x20 && buf[i] != '\n' && buf[i] != '\r' &&
+                            buf[i] != '\t' && buf[i] != '\f' && buf[i] != 0x1b)) {
+            return "data";
+        }
+    }
+    return "text";
+}
+
+// Descriptors the scan holds besides directory fds and perf counters: those
+// open now (stdio, output shards and their rings, sockets), and per thread
+// an io_uring ring or entry fd for xattrs, and for side readers the file
+// plus a directory reopened when the cache is full
+int fd_fixed_count(int threads) {
+    int n = 3 + 2 * output_shard_count;
+    DIR* d = opendir("/proc/self/fd");
+    if (d) {
+        n = -1;  // Not counting the one reading the directory
+        for (struct dirent* e; (e = readdir(d));) n += e->d_name[0] != '.';
+        closedir(d);
+    }
+    int side = (probe_pool ? probe_pool->nthreads : 0) + (content_pool ? content_pool->nthreads : 0);
+    return n + threads * (1 + async_engine) + 2 * side + FD_SPARE;
+}
+
+// Raises the soft RLIMIT_NOFILE to the hard limit and leaves half of what
+// the fixed descriptors leave over to directory fds, the rest to clients
+// and transient opens. Perf counters only get fds beyond FD_BUDGET_MIN
+// directories; profiling must not cost the scan entries.
+void fd_budget_init(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rlim_t soft = rl.rlim_cur;
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0) rl.rlim_cur = soft;
+    }
+    perf_counters_max = PERF_COUNTERS;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY) {
+        fd_budget.limit = 512;
+    } else {
+        int threads = async_engine ? ASYNC_THREADS : MAX_THREADS;
+        long avail = (rl.rlim_cur > INT_MAX ? INT_MAX : (long)rl.rlim_cur) - fd_fixed_count(threads);
+        if (profiling) {
+            long spare = (avail - 2 * FD_BUDGET_MIN) / threads;
+            if (spare < PERF_COUNTERS) {
+                perf_counters_max = spare < 0 ? 0 : (int)spare;
+                fprintf(stderr, "Profiling with at most %d of %d perf counters per thread: "
+                                "RLIMIT_NOFILE %ld leaves too few directory fds\n",
+                        perf_counters_max, PERF_COUNTERS, (long)rl.rlim_cur);
+            }
+            avail -= (long)threads * perf_counters_max;
+        }
+        fd_budget.limit = avail / 2 < 1 ? 1 : (int)(avail / 2);
+    }
+    fd_budget.open = 0;
+    fd_budget.lru_head = fd_budget.lru_tail = NULL;
+    atomic_store(&fd_budget.evictions, 0);
+    atomic_store(&fd_budget.reopens, 0);
+}
+
+void fd_lru_remove(DirNode* node) {
+    if (node->lru_prev) node->lru_prev->lru_next = node->lru_next;
+    else fd_budget.lru_head = node->lru_next;
+    if (node->lru_next) node->lru_next->lru_prev = node->lru_prev;
+    else fd_budget.lru_tail = node->lru_prev;
+    node->lru_prev = node->lru_next = NULL;
+}
+
+void fd_lru_append(DirNode* node) {
+    node->lru_prev = fd_budget.lru_tail;
+    node->lru_next = NULL;
+    if (fd_budget.lru_tail) fd_budget.lru_tail->lru_next = node;
+    else fd_budget.lru_head = node;
+    fd_budget.lru_tail = node;
+}
+
+// Closes the least recently used idle fd; caller holds the mutex
+int fd_evict(void) {
+    DirNode* victim = fd_budget.lru_head;
+    if (!victim) {
+        return -1;
+    }
+    fd_lru_remove(victim);
+    close(victim->fd);
+    count_syscall(SC_CLOSE);
+    victim->fd = -1;
+    fd_budget.open--;
+    atomic_fetch_add_explicit(&fd_budget.evictions, 1, memory_order_relaxed);
+    return 0;
+}
+
+// Caches a freshly opened fd on node, pinned for the caller, and returns
+// the fd to use. If another thread cached one first, fd is closed and that
+// one is pinned instead; if every cached fd is pinned, fd stays uncached.
+int fd_cache(DirNode* node, int fd) {
+    pthread_mutex_lock(&fd_budget.mutex);
+    if (node->fd >= 0) {
+        if (node->fd_pins++ == 0) fd_lru_remove(node);
+        int cached = node->fd;
+        pthread_mutex_unlock(&fd_budget.mutex);
+        close(fd);
+        count_syscall(SC_CLOSE);
+        return cached;
+    }
+    if (fd_budget.open < fd_budget.limit || fd_evict() == 0) {
+        node->fd = fd;
+        node->fd_pins = 1;
+        fd_budget.open++;
+    }
+    pthread_mutex_unlock(&fd_budget.mutex);
+    return fd;
+}
+
+// Pins node's cached fd so it cannot be evicted; -1 if it has none
+int fd_pin(DirNode* node) {
+    pthread_mutex_lock(&fd_budget.mutex);
+    int fd = node->fd;
+    if (fd >= 0 && node->fd_pins++ == 0) fd_lru_remove(node);
+    pthread_mutex_unlock(&fd_budget.mutex);
+    return fd;
+}
+
+// Unpins fd if it is node's cached one, or closes it if it was never cached.
+// The last unpin of a node that has lost its last fd user closes the fd.
+void fd_unpin(DirNode* node, int fd) {
+    if (fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&fd_budget.mutex);
+    int cached = node->fd == fd;
+    int unused = 0;
+    if (cached && --node->fd_pins == 0) {
+        if (atomic_load(&node->fd_users) == 0) {
+            node->fd = -1;
+            fd_budget.open--;
+            unused = 1;
+        } else {
+            fd_lru_append(node);
+        }
+    }
+    pthread_mutex_unlock(&fd_budget.mutex);
+    if (!cached || unused) {
+        close(fd);
+        count_syscall(SC_CLOSE);
+    }
+}
+
+DirNode* node_new(DirNode* parent, const char* name, size_t len) {
+    DirNode* node = malloc(sizeof(DirNode) + len + 1);
+    node->parent = parent;
+    atomic_init(&node->refs, 1);
+    atomic_init(&node->fd_users, 1);
+    node->fd = -1;
+    node->fd_pins = 0;
+    node->lru_prev = node->lru_next = NULL;
+    node->top_id = parent ? parent->top_id : 0;
+    node->name_len = len;
+    memcpy(node->name, name, len);
+    node->name[len] = '\0';
+    if (parent) {
+        atomic_fetch_add(&parent->refs, 1);
+        atomic_fetch_add(&parent->fd_users, 1);
+    }
+    return node;
+}
+
+// Drops one reference, freeing the node and any ancestors left unused
+void node_release(DirNode* node) {
+    while (node && atomic_fetch_sub(&node->refs, 1) == 1) {
+        DirNode* parent = node->parent;
+        free(node);
+        node = parent;
+    }
+}
+
+// Drops one user of the cached fd; the last user closes it. A fd still
+// pinned, as a grandparent is while a child is reopened through it, is
+// left for the last fd_unpin() to close.
+void node_fd_release(DirNode* node) {
+    if (atomic_fetch_sub(&node->fd_users, 1) != 1) {
+        return;
+    }
+    pthread_mutex_lock(&fd_budget.mutex);
+    int fd = node->fd_pins == 0 ? node->fd : -1;
+    if (fd >= 0) {
+        fd_lru_remove(node);
+        node->fd = -1;
+        fd_budget.open--;
+    }
+    pthread_mutex_unlock(&fd_budget.mutex);
+    if (fd >= 0) {
+        close(fd);
+        count_syscall(SC_CLOSE);
+    }
+}
+
+// For a node that will never be visited
+void node_discard(DirNode* node) {
+    if (node->parent) {
+        node_fd_release(node->parent);
+    }
+    node_release(node);
+}
+
+// Writes the node's full path into ws->path, leaving room for one more
+// component, and returns its length
+size_t node_path(WorkerState* ws, const DirNode* node) {
+    size_t len = 0;
+    for (const DirNode* n = node; n; n = n->parent) {
+        len += n->name_len + (n->parent ? 1 : 0);
+    }
+    if (len + NAME_MAX + 2 > ws->path_cap) {
+        ws->path_cap = (len + NAME_MAX + 2) * 2;
+        ws->path = xrealloc(ws->path, ws->path_cap);
+    }
+    size_t pos = len;
+    ws->path[len] = '\0';
+    for (const DirNode* n = node; n; n = n->parent) {
+        pos -= n->name_len;
+        memcpy(ws->path + pos, n->name, n->name_len);
+        if (n->parent) ws->path[--pos] = '/';
+    }
+    return len;
+}
+
+// Opens a directory whose parent has no cached fd by walking down from the
+// root one component at a time, so no call ever sees an over-long path.
+// Names reloaded from the spill file hold several components.
+int node_open_chain(const DirNode* node, int flags) {
+    size_t depth = 1;
+    for (const DirNode* n = node->parent; n; n = n->parent) depth++;
+    const DirNode** chain = malloc(depth * sizeof(DirNode*));
+    chain[depth - 1] = node;
+    for (size_t i = depth - 1; i > 0; i--) chain[i - 1] = chain[i]->parent;
+
+    int fd = open(chain[0]->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    count_syscall(SC_OPEN);
+    char component[NAME_MAX + 1];
+    for (size_t i = 1; i < depth && fd >= 0; i++) {
+        const char* p = chain[i]->name;
+        while (*p && fd >= 0) {
+            size_t len = strcspn(p, "/");
+            if (len > NAME_MAX) {
+                close(fd);
+                count_syscall(SC_CLOSE);
+                errno = ENAMETOOLONG;
+                fd = -1;
+                break;
+            }
+            memcpy(component, p, len);
+            component[len] = '\0';
+            p += len + (p[len] == '/');
+            int next = openat(fd, component, flags);
+            close(fd);
+            count_syscall(SC_OPEN);
+            count_syscall(SC_CLOSE);
+            fd = next;
+        }
+    }
+    free(chain);
+    return fd;
+}
+
+// Opens node through its parent's fd if that is cached, else from the root
+int node_open_uncached(DirNode* node, int flags) {
+    if (!node->parent) {
+        int fd = open(node->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        count_syscall(SC_OPEN);
+        return fd;
+    }
+    int pfd = node->name_len < PATH_MAX ? fd_pin(node->parent) : -1;
+    if (pfd < 0) {
+        return node_open_chain(node, flags);
+    }
+    int fd = openat(pfd, node->name, flags);
+    count_syscall(SC_OPEN);
+    int err = errno;
+    fd_unpin(node->parent, pfd);
+    errno = err;
+    return fd;
+}
+
+// Opens name through dir's fd; the caller holds an fd user of dir. A dir
+// whose fd was evicted or never cached is reopened and cached again for the
+// entries still to come, rather than each of them walking down from the root.
+int dir_openat(DirNode* dir, const char* name, int flags) {
+    int pfd = fd_pin(dir);
+    if (pfd < 0) {
+        int dir_flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (follow_links ? 0 : O_NOFOLLOW);
+        if ((pfd = node_open_uncached(dir, dir_flags)) < 0) {
+            return -1;
+        }
+        atomic_fetch_add_explicit(&fd_budget.reopens, 1, memory_order_relaxed);
+        pfd = fd_cache(dir, pfd);
+    }
+    int fd = openat(pfd, name, flags);
+    count_syscall(SC_OPEN);
+    int err = errno;
+    fd_unpin(dir, pfd);
+    errno = err;
+    return fd;
+}
+
+int node_open(DirNode* node) {
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (follow_links ? 0 : O_NOFOLLOW);
+    DirNode* parent = node->parent;
+    int fd;
+    int attempt = 0;
+    throttle_metadata(1);
+    do {
+        if (!parent || node->name_len >= PATH_MAX) {
+            fd = node_open_uncached(node, flags);
+        } else {
+            fd = dir_openat(parent, node->name, flags);
+        }
+    } while (fd < 0 && retry_transient(&attempt));
+    if (node->parent) {
+        int err = errno;
+        node_fd_release(node->parent);
+        errno = err;
+    }
+    return fd;
+}
+
+// Side pool items hold their directory node and one user of its fd, so
+// the entry is opened by name relative to it at any depth
+void side_hold(DirNode* dir) {
+    atomic_fetch_add(&dir->refs, 1);
+    atomic_fetch_add(&dir->fd_users, 1);
+}
+
+void side_release(DirNode* dir) {
+    node_fd_release(dir);
+    node_release(dir);
+}
+
+// Failures are retried and reported like those of the walk
+int side_item_open(const SideItem* item) {
+    const char* name = strrchr(item->path, '/');
+    name = name ? name + 1 : item->path;
+    int fd;
+    int attempt = 0;
+    do {
+        fd = dir_openat(item->dir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+    } while (fd < 0 && retry_transient(&attempt));
+    if (fd < 0) {
+        shard_error(item->shard, item->path, OP_OPEN, errno);
+    }
+    return fd;
+}
+
+void classify_file(const SideItem* item) {
+    throttle_metadata(1);
+    int fd = side_item_open(item);
+    if (fd < 0) {
+        return;
+    }
+    unsigned char buf[CONTENT_READ_SIZE];
+    ssize_t n;
+    int attempt = 0;
+    do {
+        n = pread(fd, buf, sizeof(buf), 0);
+        count_syscall(SC_READ);
+    } while (n < 0 && retry_transient(&attempt));
+    int err = errno;
+    close(fd);
+    count_syscall(SC_CLOSE);
+    if (n < 0) {
+        shard_error(item->shard, item->path, OP_READ, err);
+        return;
+    }
+    throttle_read((size_t)n);
+    const char* label = classify_content(buf, (size_t)n);
+
+    OutputShard* out = output_shard(item->shard);
+    shard_lock(out);
+    writer_printf(&out->writer, "Path: %s\n", item->path);
+    writer_printf(&out->writer, "Content: %s\n", label);
+    writer_printf(&out->writer, "-------------------\n");
+    out->records++;
+    pthread_mutex_unlock(&out->mutex);
+}
+
+// Walks the data extents of a file. Filesystems without SEEK_DATA support
+// report the whole file as a single extent.
+void probe_extents(const SideItem* item) {
+    throttle_metadata(1);
+    int fd = side_item_open(item);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    count_syscall(SC_STAT);
+    int err = fstat(fd, &st) != 0 ? errno : 0;
+    if (err || !S_ISREG(st.st_mode)) {
+        close(fd);
+        count_syscall(SC_CLOSE);
+        if (err) shard_error(item->shard, item->path, OP_STAT, err);
+        return;
+    }
+    off_t data_bytes = 0;
+    long extents = 0;
+    off_t pos = 0;
+    while (pos < st.st_size && running) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        count_syscall(SC_SEEK);
+        if (data < 0) {
+            if (errno == EINVAL) {  // Not supported: assume fully allocated
+                data_bytes = st.st_size - pos;
+                extents = 1;
+            } else if (errno != ENXIO) {
+                err = errno;
+            }
+            break;  // ENXIO: only holes remain
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        count_syscall(SC_SEEK);
+        if (hole < 0) hole = st.st_size;
+        data_bytes += hole - data;
+        extents++;
+        pos = hole;
+    }
+    close(fd);
+    count_syscall(SC_CLOSE);
+    if (err) {
+        shard_error(item->shard, item->path, OP_READ, err);
+        return;
+    }
+
+    OutputShard* out = output_shard(item->shard);
+    shard_lock(out);
+    writer_printf(&out->writer, "Path: %s\n", item->path);
+    writer_printf(&out->writer, "Data: %lld bytes in %ld extents\n", (long long)data_bytes, extents);
+    writer_printf(&out->writer, "-------------------\n");
+    out->records++;
+    pthread_mutex_unlock(&out->mutex);
+}
+
+void spill_init(SpillFile* spill) {
+    memset(spill, 0, sizeof(*spill));
+    spill->fd = -1;
+}
+
+void spill_destroy(SpillFile* spill) {
+    if (spill->fd >= 0) close(spill->fd);
+    free(spill->buf);
+    free(spill->chunk);
+    free(spill->scratch);
+}
+
+int spill_flush(SpillFile* spill) {
+    size_t off = 0;
+    while (off < spill->len) {
+        ssize_t n = pwrite(spill->fd, spill->buf + off, spill->len - off, spill->write_off);
+        count_syscall(SC_WRITE);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += (size_t)n;
+        spill->write_off += n;
+    }
+    spill->len = 0;
+    return 0;
+}
+
+// Serializes node to the spill file and releases it. Returns -1 (leaving
+// the node alone) if the file cannot be written.
+int spill_node(SpillFile* spill, DirNode* node) {
+    if (spill->fd < 0) {
+        FILE* tmp = tmpfile();
+        if (!tmp) {
+            perror("Failed to create spill file");
+            return -1;
+        }
+        spill->fd = dup(fileno(tmp));
+        fclose(tmp);
+        spill->buf = malloc(SPILL_BUF_SIZE);
+    }
+
+    size_t len = 0;
+    for (const DirNode* n = node; n->parent; n = n->parent) {
+        len += n->name_len + (n->parent->parent ? 1 : 0);
+    }
+    if (len > spill->scratch_cap) {
+        spill->scratch_cap = len * 2;
+        spill->scratch = xrealloc(spill->scratch, spill->scratch_cap);
+    }
+    size_t pos = len;
+    for (const DirNode* n = node; n->parent; n = n->parent) {
+        pos -= n->name_len;
+        memcpy(spill->scratch + pos, n->name, n->name_len);
+        if (n->parent->parent) spill->scratch[--pos] = '/';
+    }
+
+    uint32_t header[2] = {node->top_id, (uint32_t)len};
+    if (spill->len + sizeof(header) + len > SPILL_BUF_SIZE && spill_flush(spill) != 0) {
+        perror("Failed to write spill file");
+        return -1;
+    }
+    if (sizeof(header) + len > SPILL_BUF_SIZE) {
+        // Oversized record: write it straight through
+        if (pwrite(spill->fd, header, sizeof(header), spill->write_off) != sizeof(header) ||
+            pwrite(spill->fd, spill->scratch, len, spill->write_off + (off_t)sizeof(header)) != (ssize_t)len) {
+            perror("Failed to write spill file");
+            return -1;
+        }
+        spill->write_off += (off_t)(sizeof(header) + len);
+    } else {
+        memcpy(spill->buf + spill->len, header, sizeof(header));
+        memcpy(spill->buf + spill->len + sizeof(header), spill->scratch, len);
+        spill->len += sizeof(header) + len;
+    }
+    spill->count++;
+    spill->total++;
+    node_discard(node);
+    return 0;
+}
+
+#ifdef LOCKFREE_QUEUE
+// Bounded MPMC ring after Vyukov: producers and consumers each claim a
+// position with one CAS and hand the slot over through its sequence number
+void lf_init(WorkQueue* queue, size_t size) {
+    queue->slots = malloc(size * sizeof(LfSlot));
+    for (size_t i = 0; i < size; i++) atomic_init(&queue->slots[i].seq, i);
+    queue->mask = size - 1;
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+}
+
+// Returns 0 if the ring is full
+int lf_push(WorkQueue* queue, DirNode* node) {
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        LfSlot* slot = &queue->slots[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                slot->node = node;
+                atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// Returns NULL if the ring is empty
+DirNode* lf_pop(WorkQueue* queue) {
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        LfSlot* slot = &queue->slots[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                DirNode* node = slot->node;
+                atomic_store_explicit(&slot->seq, pos + queue->mask + 1, memory_order_release);
+                return node;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+#endif
+
+// A waiter takes the key and announces itself before its final check for
+// work, so a push either sees it in sleepers or is seen by the check; a
+// wake landing after the check changes seq and FUTEX_WAIT returns at once
+unsigned parker_prepare(Parker* parker) {
+    unsigned key = atomic_load(&parker->seq);
+    atomic_fetch_add(&parker->sleepers, 1);
+    return key;
+}
+
+void parker_cancel(Parker* parker) {
+    atomic_fetch_sub(&parker->sleepers, 1);
+}
+
+void parker_wait(Parker* parker, unsigned key) {
+    atomic_fetch_add_explicit(&parker->parks, 1, memory_order_relaxed);
+    syscall(SYS_futex, &parker->seq, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+    count_syscall(SC_FUTEX);
+    atomic_fetch_sub(&parker->sleepers, 1);
+}
+
+// Wakes up to n parked workers; free when nobody sleeps
+void parker_wake(Parker* parker, int n) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&parker->sleepers) == 0) return;
+    atomic_fetch_add(&parker->seq, 1);
+    syscall(SYS_futex, &parker->seq, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+    count_syscall(SC_FUTEX);
+}
+
+int queue_has_work(WorkQueue* queue) {
+#ifdef LOCKFREE_QUEUE
+    if (atomic_load(&queue->enqueue_pos) != atomic_load(&queue->dequeue_pos)) return 1;
+#endif
+    return atomic_load(&queue->queued) > 0;
+}
+
+// Directories waiting in either tier. Positions are read dequeue first, so
+// the ring's share never goes negative.
+long queue_depth(WorkQueue* queue) {
+    long depth = atomic_load(&queue->queued);
+#ifdef LOCKFREE_QUEUE
+    size_t head = atomic_load(&queue->dequeue_pos);
+    depth += (long)(atomic_load(&queue->enqueue_pos) - head);
+#endif
+    return depth;
+}
+
+// Polls briefly for new work, then parks until a push or the end of the scan
+void queue_wait(WorkQueue* queue) {
+    for (int i = 0; i < QUEUE_SPINS; i++) {
+        if (queue_has_work(queue) || !running || atomic_load(&queue->done)) return;
+        cpu_relax();
+    }
+    unsigned key = parker_prepare(&queue->parker);
+    if (queue_has_work(queue) || !running || atomic_load(&queue->done)) {
+        parker_cancel(&queue->parker);
+        return;
+    }
+    parker_wait(&queue->parker, key);
+}
+
+void queue_init(WorkQueue* queue) {
+    queue->items = malloc(QUEUE_SIZE * sizeof(DirNode*));
+    queue->capacity = QUEUE_SIZE;
+    queue->window = 0;
+    queue->root = NULL;
+    spill_init(&queue->spill);
+    queue->front = 0;
+    queue->rear = -1;
+    queue->count = 0;
+    atomic_init(&queue->parker.seq, 0);
+    atomic_init(&queue->parker.sleepers, 0);
+    atomic_init(&queue->parker.parks, 0);
+    atomic_init(&queue->queued, 0);
+    atomic_init(&queue->done, 0);
+    atomic_init(&queue->pending, 0);
+    pthread_mutex_init(&queue->mutex, NULL);
+}
+
+void queue_destroy(WorkQueue* queue) {
+    for (int i = 0; i < queue->count; i++) {
+        node_discard(queue->items[(queue->front + i) % queue->capacity]);
+    }
+    free(queue->items);
+    spill_destroy(&queue->spill);
+#ifdef LOCKFREE_QUEUE
+    DirNode* node;
+    while ((node = lf_pop(queue))) node_discard(node);
+    free(queue->slots);
+#endif
+    pthread_mutex_destroy(&queue->mutex);
+}
+
+// Doubles the ring, unrolling it so front starts at slot 0. Pushing never
+// blocks: a bounded queue deadlocks once every worker waits to push.
+void queue_grow(WorkQueue* queue) {
+    int capacity = queue->capacity * 2;
+    DirNode** items = malloc((size_t)capacity * sizeof(DirNode*));
+    for (int i = 0; i < queue->count; i++) {
+        items[i] = queue->items[(queue->front + i) % queue->capacity];
+    }
+    free(queue->items);
+    queue->items = items;
+    queue->capacity = capacity;
+    queue->front = 0;
+    queue->rear = queue->count - 1;
+}
+
+// Called once a popped directory has been fully processed. The scan is over
+// when nothing is queued and no worker can push more work.
+void queue_task_done(WorkQueue* queue) {
+    if (atomic_fetch_sub(&queue->pending, 1) == 1) {
+        atomic_store(&queue->done, 1);
+        parker_wake(&queue->parker, INT_MAX);
+    }
+}
+
+// Gives up on the records left in a spill file that can no longer be
+// written or read. They are reported against the root and taken off the
+// queue counts, so the scan still finishes. Called with the mutex held.
+void spill_lost(WorkQueue* queue, int err) {
+    SpillFile* spill = &queue->spill;
+    int lost = (int)spill->count;
+    fprintf(stderr, "Lost %d spilled directories: %s\n", lost, strerror(err));
+    shard_error(0, queue->root->name, OP_SPILL, err);
+    spill->count = 0;
+    spill->len = 0;
+    atomic_fetch_sub(&queue->queued, lost);
+    if (atomic_fetch_sub(&queue->pending, lost) == lost) {
+        atomic_store(&queue->done, 1);
+        parker_wake(&queue->parker, INT_MAX);
+    }
+}
+
+// Moves up to max spilled records back into the ring as children of root
+int spill_reload(WorkQueue* queue, int max) {
+    SpillFile* spill = &queue->spill;
+    if (spill_flush(spill) != 0) {
+        spill_lost(queue, errno);
+        return 0;
+    }
+    int loaded = 0;
+    while (loaded < max && spill->count > 0) {
+        uint32_t header[2];
+        thread_syscalls.calls[SC_READ] += 2;
+        ssize_t n = pread(spill->fd, header, sizeof(header), spill->read_off);
+        if (n != sizeof(header)) {
+            spill_lost(queue, n < 0 ? errno : EIO);
+            break;
+        }
+        if (header[1] > spill->chunk_cap) {
+            spill->chunk_cap = header[1] * 2;
+            spill->chunk = xrealloc(spill->chunk, spill->chunk_cap);
+        }
+        n = pread(spill->fd, spill->chunk, header[1], spill->read_off + (off_t)sizeof(header));
+        if (n != header[1]) {
+            spill_lost(queue, n < 0 ? errno : EIO);
+            break;
+        }
+        spill->read_off += (off_t)(sizeof(header) + header[1]);
+        spill->count--;
+
+        DirNode* node = node_new(queue->root, spill->chunk, header[1]);
+        node->top_id = header[0];
+        queue->rear = (queue->rear + 1) % queue->capacity;
+        queue->items[queue->rear] = node;
+        queue->count++;
+        loaded++;
+    }
+    if (spill->count == 0) {
+        // Everything reloaded: reuse the file from the start
+        spill->read_off = spill->write_off = 0;
+        if (ftruncate(spill->fd, 0) != 0) perror("ftruncate");
+    }
+    return loaded;
+}
+
+// Appends node to the locked ring, or to the spill file once the in-memory
+// window is full. Called with the mutex held.
+void queue_append_locked(WorkQueue* queue, DirNode* node) {
+    if (queue->window > 0 && queue->count >= queue->window && spill_node(&queue->spill, node) == 0) {
+        return;
+    }
+    if (queue->count == queue->capacity) {
+        queue_grow(queue);
+    }
+    queue->rear = (queue->rear + 1) % queue->capacity;
+    queue->items[queue->rear] = node;
+    queue->count++;
+}
+
+#ifdef LOCKFREE_QUEUE
+void queue_push_batch(WorkQueue* queue, DirNode** nodes, int n) {
+    if (!running) {
+        for (int i = 0; i < n; i++) node_discard(nodes[i]);
+        return;
+    }
+    atomic_fetch_add(&queue->pending, n);
+    int i = 0;
+    while (i < n && lf_push(queue, nodes[i])) i++;
+    if (i < n) {
+        // Ring full: park the rest in the locked tier
+        pthread_mutex_lock(&queue->mutex);
+        for (; i < n; i++) {
+            queue_append_locked(queue, nodes[i]);
+            atomic_fetch_add(&queue->queued, 1);
+        }
+        pthread_mutex_unlock(&queue->mutex);
+    }
+    parker_wake(&queue->parker, n);
+}
+
+// Takes one node from the locked tier and refills the ring from the rest,
+// so the following pops are lock-free again
+DirNode* queue_pop_overflow(WorkQueue* queue) {
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->count == 0 && queue->spill.count > 0) {
+        int batch = queue->window / 2 > 0 ? queue->window / 2 : 1;
+        spill_reload(queue, batch);
+    }
+    DirNode* node = NULL;
+    int moved = 0;
+    while (queue->count > 0) {
+        DirNode* next = queue->items[queue->front];
+        if (node && !lf_push(queue, next)) break;
+        if (node) moved++;
+        else node = next;
+        queue->front = (queue->front + 1) % queue->capacity;
+        queue->count--;
+        atomic_fetch_sub(&queue->queued, 1);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    if (moved > 0) parker_wake(&queue->parker, moved);
+    return node;
+}
+
+int queue_try_pop_batch(WorkQueue* queue, DirNode** out, int max) {
+    int n = 0;
+    while (n < max && (out[n] = lf_pop(queue))) n++;
+    if (n > 0) return n;
+    if (atomic_load(&queue->queued) > 0 && (out[0] = queue_pop_overflow(queue))) {
+        return 1;
+    }
+    return 0;
+}
+#else
+void queue_push_batch(WorkQueue* queue, DirNode** nodes, int n) {
+    pthread_mutex_lock(&queue->mutex);
+
+    if (!running) {
+        pthread_mutex_unlock(&queue->mutex);
+        for (int i = 0; i < n; i++) node_discard(nodes[i]);
+        return;
+    }
+
+    atomic_fetch_add(&queue->pending, n);
+    for (int i = 0; i < n; i++) {
+        queue_append_locked(queue, nodes[i]);
+    }
+    atomic_fetch_add(&queue->queued, n);
+
+    pthread_mutex_unlock(&queue->mutex);
+    // Wakes as many sleepers as there are new items, never more
+    parker_wake(&queue->parker, n);
+}
+
+// Takes up to max directories without blocking, leaving one for each
+// sleeping thread. The lock is only taken when the queued counter says
+// there is work.
+int queue_try_pop_batch(WorkQueue* queue, DirNode** out, int max) {
+    if (atomic_load(&queue->queued) == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&queue->mutex);
+
+    // Refill half the window at once so reloads amortize the file reads
+    int loaded = 0;
+    if (queue->count == 0 && queue->spill.count > 0 && running) {
+        int batch = queue->window / 2 > 0 ? queue->window / 2 : 1;
+        loaded = spill_reload(queue, batch);
+    }
+
+    int n = queue->count - atomic_load(&queue->parker.sleepers);
+    if (n > max) n = max;
+    if (n < 1) n = queue->count > 0;
+    for (int i = 0; i < n; i++) {
+        out[i] = queue->items[queue->front];
+        queue->front = (queue->front + 1) % queue->capacity;
+    }
+    queue->count -= n;
+    atomic_fetch_sub(&queue->queued, n);
+
+    pthread_mutex_unlock(&queue->mutex);
+    if (loaded > n) parker_wake(&queue->parker, loaded - n);
+    return n;
+}
+#endif
+
+// Blocks until it can take at least one directory; 0 once the scan is over
+int queue_pop_batch(WorkQueue* queue, DirNode** out, int max) {
+    for (;;) {
+        int n = queue_try_pop_batch(queue, out, max);
+        if (n > 0) return n;
+        if (!running || atomic_load(&queue->done)) return 0;
+        uint64_t start = trace_wait_begin();
+        queue_wait(queue);
+        trace_wait_end(start, TRACE_QUEUE_WAIT);
+    }
+}
+
+void queue_push(WorkQueue* queue, DirNode* node) {
+    queue_push_batch(queue, &node, 1);
+}
+
+void handle_signal(int signum) {
+    running = 0;
+    parker_wake(&work_queue.parker, INT_MAX);
+}
+
+void index_add(ScanIndex* index, const FileInfo* info) {
+    char* path = strdup(info->path);
+    pthread_mutex_lock(&index->mutex);
+    if (index->count == index->cap) {
+        index->cap = index->cap ? index->cap * 2 : 1024;
+        index->entries = realloc(index->entries, index->cap * sizeof(IndexEntry));
+    }
+    IndexEntry* e = &index->entries[index->count++];
+    e->path = path;
+    e->size = info->size;
+    e->mode = info->mode;
+    e->mtime = info->mtime;
+    pthread_mutex_unlock(&index->mutex);
+}
+
+void xattr_text_append(WorkerState* ws, const char* data, size_t len) {
+    if (ws->xattr_text_len + len + 1 > ws->xattr_text_cap) {
+        ws->xattr_text_cap = (ws->xattr_text_len + len + 1) * 2;
+        ws->xattr_text = xrealloc(ws->xattr_text, ws->xattr_text_cap);
+    }
+    memcpy(ws->xattr_text + ws->xattr_text_len, data, len);
+    ws->xattr_text_len += len;
+    ws->xattr_text[ws->xattr_text_len] = '\0';
+}
+
+// Printable bytes pass through; anything else becomes \xNN
+void xattr_append_escaped(WorkerState* ws, const char* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)data[i];
+        if (c >= 0x20 && c < 0x7f && c != '\\' && c != ' ' && c != '=') {
+            xattr_text_append(ws, (const char*)&c, 1);
+        } else {
+            char esc[5];
+            snprintf(esc, sizeof(esc), "\\x%02x", c);
+            xattr_text_append(ws, esc, 4);
+        }
+    }
+}
+
+// Renders a system.posix_acl_* value (header + {tag, perm, id} entries) in
+// the usual text form, e.g. user::rw-,user:1000:r--,group::r--,mask::r--
+int xattr_append_acl(WorkerState* ws, const char* data, size_t len) {
+    uint32_t version;
+    if (len < 4 || (len - 4) % 8 != 0) return -1;
+    memcpy(&version, data, 4);
+    if (version != 2) return -1;
+    for (size_t off = 4; off < len; off += 8) {
+        uint16_t tag, perm;
+        uint32_t id;
+        memcpy(&tag, data + off, 2);
+        memcpy(&perm, data + off + 2, 2);
+        memcpy(&id, data + off + 4, 4);
+        const char* kind = tag == 0x01 || tag == 0x02 ? "user" : tag == 0x04 || tag == 0x08 ? "group" :
+                           tag == 0x10 ? "mask" : tag == 0x20 ? "other" : "?";
+        char entry[64];
+        int n;
+        if (tag == 0x02 || tag == 0x08) {
+            n = snprintf(entry, sizeof(entry), "%s%s:%u:", off > 4 ? "," : "", kind, id);
+        } else {
+            n = snprintf(entry, sizeof(entry), "%s%s::", off > 4 ? "," : "", kind);
+        }
+        xattr_text_append(ws, entry, (size_t)n);
+        char bits[3] = {perm & 4 ? 'r' : '-', perm & 2 ? 'w' : '-', perm & 1 ? 'x' : '-'};
+        xattr_text_append(ws, bits, 3);
+    }
+    return 0;
+}
+
+#ifndef SYS_getxattrat
+#define SYS_getxattrat 464
+#endif
+#ifndef SYS_listxattrat
+#define SYS_listxattrat 465
+#endif
+
+typedef struct {
+    uint64_t value;
+    uint32_t size;
+    uint32_t flags;
+} XattrArgs;             // struct xattr_args of getxattrat
+
+int xattrat_missing;     // Kernel predates listxattrat and getxattrat (6.13)
+
+// Attribute calls on the entry ws->name relative to the listing fd. Older
+// kernels use an fd on the entry, or without one /proc/self/fd/<dir>/<name>,
+// which does not follow a final symlink either.
+ssize_t xattr_list(const WorkerState* ws, int fd, const char* proc, char* buf, size_t size) {
+    if (!xattrat_missing) {
+        ssize_t n = syscall(SYS_listxattrat, ws->dir_fd, ws->name, AT_SYMLINK_NOFOLLOW, buf, size);
+        if (n >= 0 || errno != ENOSYS) return n;
+        xattrat_missing = 1;
+    }
+    return fd >= 0 ? flistxattr(fd, buf, size) : llistxattr(proc, buf, size);
+}
+
+ssize_t xattr_get(const WorkerState* ws, int fd, const char* proc, const char* name,
+                  void* buf, size_t size) {
+    if (!xattrat_missing) {
+        XattrArgs args = {(uint64_t)(uintptr_t)buf, (uint32_t)size, 0};
+        ssize_t n = syscall(SYS_getxattrat, ws->dir_fd, ws->name, AT_SYMLINK_NOFOLLOW, name,
+                            &args, sizeof(args));
+        if (n >= 0 || errno != ENOSYS) return n;
+        xattrat_missing = 1;
+    }
+    return fd >= 0 ? fgetxattr(fd, name, buf, size) : lgetxattr(proc, name, buf, size);
+}
+
+// Fills ws->xattr_text with rendered name/value pairs of the entry ws->name
+// in ws->dir_fd and returns the pair count; path is only for reports.
+// Every call resolves only the name relative to the listing fd, never
+// the full path, however long it is. Without the *xattrat calls, regular
+// files and directories that have attributes are opened once to read the
+// values through the fd; other types must not be opened (a device open
+// can act on the device) and stay on the /proc entry.
+size_t read_xattrs(WorkerState* ws, const char* path, mode_t mode) {
+    ws->xattr_text_len = 0;
+    if (!ws->xattr_names) {
+        // A zero-sized buffer would make the calls below return sizes only
+        ws->xattr_names_cap = ws->xattr_value_cap = 1024;
+        ws->xattr_names = xrealloc(NULL, ws->xattr_names_cap);
+        ws->xattr_value = xrealloc(NULL, ws->xattr_value_cap);
+    }
+    int fd = -1;
+    char proc[32 + NAME_MAX];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d/%s", ws->dir_fd, ws->name);
+
+    ssize_t len;
+    throttle_metadata(1);
+    for (;;) {
+        len = xattr_list(ws, fd, proc, ws->xattr_names, ws->xattr_names_cap);
+        count_syscall(SC_XATTR);
+        if (len >= 0) break;
+        if (errno != ERANGE) {
+            if (errno != ENOTSUP) scan_error(ws, path, OP_XATTR, errno);
+            len = 0;
+            break;
+        }
+        ssize_t need = xattr_list(ws, fd, proc, NULL, 0);  // List grew: size it and retry
+        count_syscall(SC_XATTR);
+        if (need < 0) {
+            len = 0;
+            break;
+        }
+        ws->xattr_names_cap = (size_t)need + 256;
+        ws->xattr_names = xrealloc(ws->xattr_names, ws->xattr_names_cap);
+    }
+    if (len > 0 && xattrat_missing && (S_ISREG(mode) || S_ISDIR(mode))) {
+        // Unreadable entries keep using the /proc entry
+        fd = openat(ws->dir_fd, ws->name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+        count_syscall(SC_OPEN);
+    }
+
+    size_t pairs = 0;
+    for (const char* name = ws->xattr_names; name < ws->xattr_names + len; name += strlen(name) + 1) {
+        throttle_metadata(1);
+        ssize_t vlen = xattr_get(ws, fd, proc, name, ws->xattr_value, ws->xattr_value_cap);
+        count_syscall(SC_XATTR);
+        if (vlen < 0 && errno == ERANGE) {
+            thread_syscalls.calls[SC_XATTR] += 2;
+            ssize_t need = xattr_get(ws, fd, proc, name, NULL, 0);
+            if (need < 0) continue;
+            ws->xattr_value_cap = (size_t)need + 256;
+            ws->xattr_value = xrealloc(ws->xattr_value, ws->xattr_value_cap);
+            vlen = xattr_get(ws, fd, proc, name, ws->xattr_value, ws->xattr_value_cap);
+        }
+        if (vlen < 0) {
+            if (errno != ENODATA) scan_error(ws, path, OP_XATTR, errno);
+            continue;
+        }
+
+        xattr_append_escaped(ws, name, strlen(name));
+        xattr_text_append(ws, "", 1);
+        size_t mark = ws->xattr_text_len;
+        if (strncmp(name, "system.posix_acl_", 17) != 0 ||
+            xattr_append_acl(ws, ws->xattr_value, (size_t)vlen) != 0) {
+            ws->xattr_text_len = mark;
+            xattr_append_escaped(ws, ws->xattr_value, (size_t)vlen);
+        }
+        xattr_text_append(ws, "", 1);
+        pairs++;
+    }
+    if (fd >= 0) {
+        close(fd);
+        count_syscall(SC_CLOSE);
+    }
+    return pairs;
+}
+
+// Interns the pending pairs, emitting a Dict line for each new string so
+// readers of the shard always see a definition before its first use.
+// Caller holds the shard's mutex.
+void write_xattr_dict(WorkerState* ws, size_t pairs, OutputShard* out) {
+    if (ws->xattr_ids_cap < pairs * 2) {
+        ws->xattr_ids_cap = pairs * 2;
+        ws->xattr_ids = xrealloc(ws->xattr_ids, ws->xattr_ids_cap * sizeof(uint32_t));
+    }
+    const char* p = ws->xattr_text;
+    for (size_t i = 0; i < pairs * 2; i++) {
+        size_t len = strlen(p);
+        size_t before = out->dict.count;
+        ws->xattr_ids[i] = strtab_intern(&out->dict, p, len);
+        if (out->dict.count != before) {
+            writer_printf(&out->writer, "Dict: %u %s\n", ws->xattr_ids[i], p);
+        }
+        p += len + 1;
+    }
+}
+
+void visited_init(void) {
+    for (int i = 0; i < VISITED_SHARDS; i++) {
+        pthread_mutex_init(&visited[i].mutex, NULL);
+        visited[i].devs = NULL;
+        visited[i].inos = NULL;
+        visited[i].used = NULL;
+        visited[i].n = 0;
+        visited[i].nslots = 0;
+    }
+}
+
+void visited_destroy(void) {
+    for (int i = 0; i < VISITED_SHARDS; i++) {
+        pthread_mutex_destroy(&visited[i].mutex);
+        free(visited[i].devs);
+        free(visited[i].inos);
+        free(visited[i].used);
+    }
+}
+
+size_t visited_probe(const VisitedShard* shard, uint64_t h, dev_t dev, ino_t ino) {
+    size_t i = h & (shard->nslots - 1);
+    while (shard->used[i] && (shard->devs[i] != dev || shard->inos[i] != ino)) {
+        i = (i + 1) & (shard->nslots - 1);
+    }
+    return i;
+}
+
+// Returns 1 if (dev, ino) was not in the set and has now been added
+int visited_insert(dev_t dev, ino_t ino) {
+    uint64_t h = hash_u64((uint64_t)dev * 0x9e3779b97f4a7c15ULL ^ (uint64_t)ino);
+    VisitedShard* shard = &visited[h >> 56 & (VISITED_SHARDS - 1)];
+    h &= (1ULL << 56) - 1;  // Slot bits independent of the stripe choice
+
+    pthread_mutex_lock(&shard->mutex);
+    if (shard->n + 1 > shard->nslots / 2) {
+        VisitedShard bigger = *shard;
+        bigger.nslots = shard->nslots ? shard->nslots * 2 : 64;
+        bigger.devs = malloc(bigger.nslots * sizeof(dev_t));
+        bigger.inos = malloc(bigger.nslots * sizeof(ino_t));
+        bigger.used = calloc(bigger.nslots, 1);
+        for (size_t i = 0; i < shard->nslots; i++) {
+            if (!shard->used[i]) continue;
+            uint64_t hi = hash_u64((uint64_t)shard->devs[i] * 0x9e3779b97f4a7c15ULL ^ (uint64_t)shard->inos[i]);
+            size_t j = visited_probe(&bigger, hi & ((1ULL << 56) - 1), shard->devs[i], shard->inos[i]);
+            bigger.used[j] = 1;
+            bigger.devs[j] = shard->devs[i];
+            bigger.inos[j] = shard->inos[i];
+        }
+        free(shard->devs);
+        free(shard->inos);
+        free(shard->used);
+        shard->devs = bigger.devs;
+        shard->inos = bigger.inos;
+        shard->used = bigger.used;
+        shard->nslots = bigger.nslots;
+    }
+    size_t i = visited_probe(shard, h, dev, ino);
+    int added = !shard->used[i];
+    if (added) {
+        shard->used[i] = 1;
+        shard->devs[i] = dev;
+        shard->inos[i] = ino;
+        shard->n++;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return added;
+}
+
+// Records one directory entry; st is its lstat result
+void process_file(WorkerState* ws, const char* path, const struct stat* st, int dangling) {
+    off_t allocated = (off_t)st->st_blocks * 512;
+    ws->entries++;
+    if (thread_metrics) {
+        metric_add(&thread_metrics->entries, 1);
+    }
+    int sparse = S_ISREG(st->st_mode) && allocated < st->st_size;
+    ws->apparent_bytes += st->st_size;
+    ws->allocated_bytes += allocated;
+    ws->sparse_files += sparse;
+    if (accounting) {
+        usage_add(ws, st);
+    }
+    if (probe_pool && S_ISREG(st->st_mode) && st->st_size >= probe_min_size) {
+        side_hold(ws->dir);
+        side_pool_submit(probe_pool, path, shard_key(ws), ws->dir);
+    }
+    if (content_pool && S_ISREG(st->st_mode)) {
+        side_hold(ws->dir);
+        side_pool_submit(content_pool, path, shard_key(ws), ws->dir);
+    }
+    
+    FileInfo info;
+    info.path = path;
+    info.size = st->st_size;
+    info.mode = st->st_mode;
+    info.mtime = st->st_mtime;
+    info.uid = st->st_uid;
+    info.gid = st->st_gid;
+
+    if (scan_index) {
+        index_add(scan_index, &info);
+    }
+    if (!output_shards) {
+        return;
+    }
+    size_t xattr_pairs = collect_xattrs ? read_xattrs(ws, path, st->st_mode) : 0;
+    
+    perf_phase(PHASE_FORMAT);
+    OutputShard* out = output_shard(shard_key(ws));
+    shard_lock(out);
+    if (xattr_pairs) {
+        write_xattr_dict(ws, xattr_pairs, out);
+    }
+    writer_printf(&out->writer, "Path: %s\n", info.path);
+    writer_printf(&out->writer, "Size: %ld bytes\n", (long)info.size);
+    writer_printf(&out->writer, "Allocated: %ld bytes\n", (long)allocated);
+    if (sparse) {
+        writer_printf(&out->writer, "Sparse: yes\n");
+    }
+    if (dangling) {
+        writer_printf(&out->writer, "Dangling: yes\n");
+    }
+    writer_printf(&out->writer, "Type: %s\n", S_ISDIR(info.mode) ? "Directory" :
+                                               S_ISREG(info.mode) ? "Regular File" :
+                                               S_ISLNK(info.mode) ? "Symbolic Link" : "Other");
+    writer_printf(&out->writer, "Permissions: %o\n", info.mode & 0777);
+    writer_printf(&out->writer, "Owner: %u:%u\n", (unsigned)info.uid, (unsigned)info.gid);
+    char when[32];
+    writer_printf(&out->writer, "Last Modified: %s", ctime_r(&info.mtime, when));
+    if (xattr_pairs) {
+        writer_printf(&out->writer, "Xattrs:");
+        for (size_t i = 0; i < xattr_pairs; i++) {
+            writer_printf(&out->writer, " %u=%u", ws->xattr_ids[2 * i], ws->xattr_ids[2 * i + 1]);
+        }
+        writer_printf(&out->writer, "\n");
+    }
+    writer_printf(&out->writer, "-------------------\n");
+    out->records++;
+    pthread_mutex_unlock(&out->mutex);
+}
+
+// Opens a popped directory, caching the fd on the node for the children's
+// openat. It stays pinned until the listing is done.
+int visit_open(WorkerState* ws, DirNode* node) {
+    int fd = node_open(node);
+    if (fd < 0) {
+        int err = errno;
+        node_path(ws, node);
+        scan_error(ws, ws->path, OP_OPEN, err);
+        return fd;
+    }
+    return fd_cache(node, fd);
+}
+
+void visit_finish(DirNode* node, int fd) {
+    fd_unpin(node, fd);
+    node_fd_release(node);
+    node_release(node);
+    queue_task_done(&work_queue);
+}
+
+void flush_children(WorkerState* ws) {
+    if (ws->nchildren > 0) {
+        queue_push_batch(&work_queue, ws->children, ws->nchildren);
+        ws->nchildren = 0;
+    }
+}
+
+// lstat of name in dirfd, tried again after transient failures
+int stat_entry(int dirfd, const char* name, struct stat* st) {
+    int ret;
+    int attempt = 0;
+    throttle_metadata(1);
+    uint64_t timed = metrics_stat_begin();
+    do {
+        ret = fstatat(dirfd, name, st, AT_SYMLINK_NOFOLLOW);
+        count_syscall(SC_STAT);
+    } while (ret == -1 && retry_transient(&attempt));
+    metrics_stat_end(timed);
+    return ret;
+}
+
+// The same through statx, returning 0 or -errno like a ring completion
+int statx_entry(int dirfd, const char* name, struct statx* stx) {
+    int ret;
+    int attempt = 0;
+    throttle_metadata(1);
+    uint64_t timed = metrics_stat_begin();
+    do {
+        ret = statx(dirfd, name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, stx);
+        count_syscall(SC_STAT);
+    } while (ret == -1 && retry_transient(&attempt));
+    metrics_stat_end(timed);
+    return ret == 0 ? 0 : -errno;
+}
+
+// Reports a failure on one entry of the directory whose path ws->path holds
+void entry_error(WorkerState* ws, size_t dir_len, const char* name, int op, int err) {
+    memcpy(ws->path + dir_len + 1, name, strlen(name) + 1);
+    scan_error(ws, ws->path, op, err);
+}
+
+// Records one entry of node from its lstat result and collects it for the
+// next batched push if it is to be descended. ws->path holds the directory
+// path and a '/' at dir_len. Shared by both engines.
+void scan_entry(WorkerState* ws, DirNode* node, int fd, size_t dir_len,
+                const char* name, const struct stat* st) {
+    size_t name_len = strlen(name);
+    memcpy(ws->path + dir_len + 1, name, name_len + 1);
+    perf_phase(PHASE_METADATA);
+
+    // In follow mode a link to a directory is descended like one;
+    // the visited set keeps cycles and aliases from being rescanned
+    int descend = S_ISDIR(st->st_mode);
+    int dangling = 0;
+    if (follow_links) {
+        struct stat target;
+        if (S_ISLNK(st->st_mode)) {
+            throttle_metadata(1);
+            count_syscall(SC_STAT);
+            if (fstatat(fd, name, &target, 0) == -1) {
+                dangling = errno == ENOENT || errno == ELOOP || errno == ENOTDIR;
+                ws->dangling_links += dangling;
+                if (!dangling) scan_error(ws, ws->path, OP_STAT, errno);
+            } else if (S_ISDIR(target.st_mode)) {
+                descend = visited_insert(target.st_dev, target.st_ino);
+            }
+        } else if (descend) {
+            descend = visited_insert(st->st_dev, st->st_ino);
+        }
+    }
+
+    // Entries below a top-level directory all share its id
+    ws->top_id = node->top_id;
+    if ((accounting || shard_by_top) && !node->parent) {
+        ws->top_id = top_intern(name, name_len);
+    }
+    ws->dir = node;
+    ws->dir_fd = fd;
+    ws->name = name;
+    process_file(ws, ws->path, st, dangling);
+    perf_phase(PHASE_TRAVERSE);
+
+    if (descend) {
+        DirNode* child = node_new(node, name, name_len);
+        child->top_id = ws->top_id;
+        ws->children[ws->nchildren++] = child;
+        if (ws->nchildren == PUSH_BATCH) {
+            flush_children(ws);
+        }
+    }
+}
+
+void* worker_thread(void* arg) {
+    WorkerState* ws = arg;
+    pthread_t thread_id = pthread_self();
+    printf("Thread ID: %lu started\n", (unsigned long)thread_id);
+    ws->dirents = malloc(DIRENT_BUF_SIZE);
+    stage_priority_apply(STAGE_SCAN);
+    perf_thread_start();
+    trace_thread_start(ws->id);
+    metrics_thread_start(ws->id);
+    DirNode* batch[POP_BATCH];
+    int nbatch = 0;
+    int next = 0;
+    while (running) {
+        if (next == nbatch) {
+            nbatch = queue_pop_batch(&work_queue, batch, POP_BATCH);
+            next = 0;
+            if (nbatch == 0) {
+                break;
+            }
+        }
+        DirNode* node = batch[next++];
+        uint64_t traced = trace_visit_begin(node->name, node->name_len);
+        long entries = ws->entries;
+
+        int fd = visit_open(ws, node);
+        if (fd >= 0) {
+            size_t dir_len = node_path(ws, node);
+            ws->path[dir_len] = '/';
+
+            ssize_t nread = 0;
+            while (running && (nread = read_dirents(fd, ws->dirents, DIRENT_BUF_SIZE)) > 0) {
+                for (ssize_t off = 0; off < nread && running;) {
+                    struct dirent64* entry = (struct dirent64*)(ws->dirents + off);
+                    off += entry->d_reclen;
+                    const char* name = entry->d_name;
+                    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                        continue;
+                    }
+
+                    struct stat st;
+                    perf_phase(PHASE_METADATA);
+                    if (stat_entry(fd, name, &st) == -1) {
+                        entry_error(ws, dir_len, name, OP_STAT, errno);
+                        perf_phase(PHASE_TRAVERSE);
+                        continue;
+                    }
+                    scan_entry(ws, node, fd, dir_len, name, &st);
+                }
+            }
+            if (running && nread < 0) {
+                ws->path[dir_len] = '\0';
+                scan_error(ws, ws->path, OP_READDIR, errno);
+            }
+            flush_children(ws);
+        }
+        visit_finish(node, fd);
+        trace_visit_end(traced, ws->entries - entries);
+    }
+
+    // Interrupted: drop what was popped but never listed
+    while (next < nbatch) {
+        node_discard(batch[next++]);
+    }
+
+    free(ws->dirents);
+    trace_thread_stop();
+    perf_thread_stop();
+    syscalls_merge();
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Async engine: directory visits as stackless coroutines over io_uring
+// ---------------------------------------------------------------------------
+
+enum { VISIT_IDLE, VISIT_OPEN, VISIT_LIST, VISIT_STAT, VISIT_EMIT };
+
+// One directory in progress. Its state survives suspension, so a thread
+// can interleave hundreds of them without a stack each.
+typedef struct {
+    int state;
+    DirNode* node;
+    int fd;
+    char* dirents;
+    const char** names;   // Entries of the current chunk, into dirents
+    struct statx* stx;
+    int* results;         // 0 or -errno per entry
+    int nentries;
+    int cap;
+    int submitted;        // Statx requests queued on the ring
+    int completed;
+} DirVisit;
+
+typedef struct {
+    WorkerState* ws;
+    Uring ring;
+    int use_ring;
+    DirVisit visits[ASYNC_VISITS];
+    int active;
+} AsyncWorker;
+
+atomic_long async_statx_ring;     // Statx calls completed through io_uring
+atomic_long async_statx_sync;     // Statx calls made synchronously
+atomic_int async_peak_visits;     // Most directories in progress at once
+atomic_int async_active_visits;
+
+void statx_to_stat(const struct statx* stx, struct stat* st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    st->st_size = (off_t)stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = (blkcnt_t)stx->stx_blocks;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+void visit_end(AsyncWorker* aw, DirVisit* v) {
+    visit_finish(v->node, v->fd);
+    v->node = NULL;
+    v->state = VISIT_IDLE;
+    aw->active--;
+    atomic_fetch_sub(&async_active_visits, 1);
+}
+
+// Splits the next getdents64 chunk into entry names. Returns 0 at the end
+// of the directory and -1 with errno set if it cannot be read.
+int visit_list(DirVisit* v) {
+    ssize_t nread = read_dirents(v->fd, v->dirents, ASYNC_DIRENT_SIZE);
+    if (nread <= 0) {
+        return nread < 0 ? -1 : 0;
+    }
+    v->nentries = 0;
+    for (ssize_t off = 0; off < nread;) {
+        struct dirent64* entry = (struct dirent64*)(v->dirents + off);
+        off += entry->d_reclen;
+        const char* name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        if (v->nentries == v->cap) {
+            v->cap = v->cap ? v->cap * 2 : 64;
+            v->names = xrealloc(v->names, (size_t)v->cap * sizeof(char*));
+            v->stx = xrealloc(v->stx, (size_t)v->cap * sizeof(struct statx));
+            v->results = xrealloc(v->results, (size_t)v->cap * sizeof(int));
+        }
+        v->names[v->nentries++] = name;
+    }
+    v->submitted = 0;
+    v->completed = 0;
+    return 1;
+}
+
+// Resumes a visit until it has to wait on the ring or the directory is done
+void visit_run(AsyncWorker* aw, DirVisit* v) {
+    for (;;) {
+        switch (v->state) {
+        case VISIT_OPEN:
+            v->fd = visit_open(aw->ws, v->node);
+            if (v->fd < 0) {
+                visit_end(aw, v);
+                return;
+            }
+            v->state = VISIT_LIST;
+            break;
+
+        case VISIT_LIST: {
+            int listed = running ? visit_list(v) : 0;
+            if (listed < 0) {
+                int err = errno;
+                node_path(aw->ws, v->node);
+                scan_error(aw->ws, aw->ws->path, OP_READDIR, err);
+            }
+            if (listed <= 0) {
+                visit_end(aw, v);
+                return;
+            }
+            v->state = VISIT_STAT;
+            break;
+        }
+
+        case VISIT_STAT:
+            if (!aw->use_ring) {
+                int phase = perf_phase(PHASE_METADATA);
+                for (int i = 0; i < v->nentries; i++) {
+                    v->results[i] = statx_entry(v->fd, v->names[i], &v->stx[i]);
+                }
+                atomic_fetch_add_explicit(&async_statx_sync, v->nentries, memory_order_relaxed);
+                perf_phase(phase);
+                v->submitted = v->completed = v->nentries;
+            }
+            while (v->submitted < v->nentries) {
+                struct io_uring_sqe* sqe = uring_get_sqe(&aw->ring);
+                if (!sqe) {
+                    return;  // Resumed once the ring drains
+                }
+                int i = v->submitted++;
+                throttle_metadata(1);
+                sqe->opcode = IORING_OP_STATX;
+                sqe->fd = v->fd;
+                sqe->addr = (uint64_t)(uintptr_t)v->names[i];
+                sqe->len = STATX_BASIC_STATS;
+                sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+                sqe->off = (uint64_t)(uintptr_t)&v->stx[i];
+                sqe->user_data = (uint64_t)(v - aw->visits) << 32 | (uint32_t)i;
+            }
+            if (v->completed < v->nentries) {
+                return;  // Resumed by the last completion
+            }
+            v->state = VISIT_EMIT;
+            break;
+
+        case VISIT_EMIT: {
+            WorkerState* ws = aw->ws;
+            size_t dir_len = node_path(ws, v->node);
+            ws->path[dir_len] = '/';
+            for (int i = 0; i < v->nentries && running; i++) {
+                if (v->results[i] != 0 && error_transient(-v->results[i])) {
+                    // Backing off inside the ring would stall every visit
+                    v->results[i] = statx_entry(v->fd, v->names[i], &v->stx[i]);
+                }
+                if (v->results[i] != 0) {
+                    entry_error(ws, dir_len, v->names[i], OP_STAT, -v->results[i]);
+                    continue;
+                }
+                struct stat st;
+                statx_to_stat(&v->stx[i], &st);
+                scan_entry(ws, v->node, v->fd, dir_len, v->names[i], &st);
+            }
+            flush_children(ws);
+            v->state = VISIT_LIST;
+            break;
+        }
+
+        default:
+            return;
+        }
+    }
+}
+
+int visit_runnable(const DirVisit* v) {
+    return v->state == VISIT_OPEN ||
+           (v->state == VISIT_STAT && (v->submitted < v->nentries || v->completed == v->nentries));
+}
+
+void async_reap(AsyncWorker* aw) {
+    Uring* ring = &aw->ring;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    long n = 0;
+    for (; head != tail; head++, n++) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+        DirVisit* v = &aw->visits[cqe->user_data >> 32];
+        v->results[(uint32_t)cqe->user_data] = cqe->res;
+        v->completed++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    ring->inflight -= (unsigned)n;
+    atomic_fetch_add_explicit(&async_statx_ring, n, memory_order_relaxed);
+}
+
+// Event loop of one engine thread: admits queued directories as visits,
+// resumes whichever can make progress and sleeps in io_uring_enter only
+// when every visit waits on a completion
+void* async_worker_thread(void* arg) {
+    AsyncWorker* aw = calloc(1, sizeof(AsyncWorker));
+    aw->ws = arg;
+    stage_priority_apply(STAGE_SCAN);
+    perf_thread_start();
+    trace_thread_start(aw->ws->id);
+    metrics_thread_start(aw->ws->id);
+    aw->use_ring = uring_init(&aw->ring, ASYNC_RING_ENTRIES) == 0;
+    printf("Thread ID: %lu started (%s)\n", (unsigned long)pthread_self(),
+           aw->use_ring ? "io_uring" : "synchronous statx");
+    // Every visit holds a directory fd; share half the directory budget
+    int max_visits = fd_budget.limit / (2 * ASYNC_THREADS);
+    if (max_visits > ASYNC_VISITS) max_visits = ASYNC_VISITS;
+    if (max_visits < 1) max_visits = 1;
+
+    for (;;) {
+        int free_slots = max_visits - aw->active;
+        if (running && free_slots > 0) {
+            DirNode* batch[ASYNC_POP_BATCH];
+            int max = free_slots < ASYNC_POP_BATCH ? free_slots : ASYNC_POP_BATCH;
+            int n = aw->active == 0 ? queue_pop_batch(&work_queue, batch, max)
+                                    : queue_try_pop_batch(&work_queue, batch, max);
+            for (int i = 0, slot = 0; i < n; i++) {
+                while (aw->visits[slot].state != VISIT_IDLE) slot++;
+                DirVisit* v = &aw->visits[slot];
+                if (!v->dirents) v->dirents = malloc(ASYNC_DIRENT_SIZE);
+                v->node = batch[i];
+                v->fd = -1;
+                v->state = VISIT_OPEN;
+                aw->active++;
+            }
+            int now = atomic_fetch_add(&async_active_visits, n) + n;
+            int peak = atomic_load(&async_peak_visits);
+            while (now > peak && !atomic_compare_exchange_weak(&async_peak_visits, &peak, now)) {}
+        }
+        if (aw->active == 0) {
+            break;
+        }
+
+        int blocked_on_sq = 0;
+        for (int i = 0; i < ASYNC_VISITS; i++) {
+            DirVisit* v = &aw->visits[i];
+            if (visit_runnable(v)) {
+                // A visit is traced as the slices in which it records entries
+                uint64_t traced = trace_visit_begin(v->node->name, v->node->name_len);
+                long entries = aw->ws->entries;
+                visit_run(aw, v);
+                entries = aw->ws->entries - entries;
+                trace_visit_end(entries > 0 ? traced : 0, entries);
+                blocked_on_sq |= v->state == VISIT_STAT && v->submitted < v->nentries;
+            }
+        }
+        if (aw->use_ring && (aw->ring.queued > 0 || aw->ring.inflight > 0)) {
+            uint64_t start = blocked_on_sq ? 0 : trace_wait_begin();
+            int ret = uring_submit(&aw->ring, !blocked_on_sq);
+            trace_wait_end(start, TRACE_RING_WAIT);
+            if (ret != 0) {
+                perror("io_uring_enter");
+                if (aw->ring.inflight == 0) {
+                    // Ring unusable: redo unfinished chunks synchronously
+                    aw->use_ring = 0;
+                    for (int i = 0; i < ASYNC_VISITS; i++) {
+                        if (aw->visits[i].state == VISIT_STAT) {
+                            aw->visits[i].submitted = aw->visits[i].completed = 0;
+                        }
+                    }
+                    continue;
+                }
+            }
+            async_reap(aw);
+        }
+    }
+
+    for (int i = 0; i < ASYNC_VISITS; i++) {
+        free(aw->visits[i].dirents);
+        free(aw->visits[i].names);
+        free(aw->visits[i].stx);
+        free(aw->visits[i].results);
+    }
+    if (aw->use_ring) {
+        uring_destroy(&aw->ring);
+    }
+    free(aw);
+    trace_thread_stop();
+    perf_thread_stop();
+    syscalls_merge();
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Owner accounting: merges per-worker usage tables into a report
+// ---------------------------------------------------------------------------
+
+// uid/gid -> name, resolved at most once per id
+typedef struct {
+    uint32_t* ids;
+    char** names;
+    size_t n;
+    size_t nslots;
+} NameCache;
+
+NameCache user_names;
+NameCache group_names;
+
+char* resolve_name(uint32_t id, int is_group) {
+    char buf[16384];
+    char* name = NULL;
+    if (id == UINT32_MAX) {
+        return strdup("?");
+    }
+    if (is_group) {
+        struct group gr, *res = NULL;
+        if (getgrgid_r(id, &gr, buf, sizeof(buf), &res) == 0 && res) name = strdup(res->gr_name);
+    } else {
+        struct passwd pw, *res = NULL;
+        if (getpwuid_r(id, &pw, buf, sizeof(buf), &res) == 0 && res) name = strdup(res->pw_name);
+    }
+    if (!name) {
+        snprintf(buf, sizeof(buf), "%u", id);  // No passwd/group entry
+        name = strdup(buf);
+    }
+    return name;
+}
+
+const char* cached_name(NameCache* c, uint32_t id, int is_group) {
+    if (c->n + 1 > c->nslots / 2) {
+        NameCache bigger = {NULL, NULL, c->n, c->nslots ? c->nslots * 2 : 64};
+        bigger.ids = calloc(bigger.nslots, sizeof(uint32_t));
+        bigger.names = calloc(bigger.nslots, sizeof(char*));
+        for (size_t i = 0; i < c->nslots; i++) {
+            if (!c->names[i]) continue;
+            size_t j = hash_u64(c->ids[i]) & (bigger.nslots - 1);
+            while (bigger.names[j]) j = (j + 1) & (bigger.nslots - 1);
+            bigger.ids[j] = c->ids[i];
+            bigger.names[j] = c->names[i];
+        }
+        free(c->ids);
+        free(c->names);
+        *c = bigger;
+    }
+    size_t i = hash_u64(id) & (c->nslots - 1);
+    while (c->names[i] && c->ids[i] != id) i = (i + 1) & (c->nslots - 1);
+    if (!c->names[i]) {
+        c->ids[i] = id;
+        c->names[i] = resolve_name(id, is_group);
+        c->n++;
+    }
+    return c->names[i];
+}
+
+void group_merge(GroupTable* into, const GroupTable* from) {
+    for (size_t i = 0; i < from->nslots; i++) {
+        if (!from->used[i]) continue;
+        size_t slot = group_slot(into, from->keys[i]);
+        into->counts[slot] += from->counts[i];
+        into->bytes[slot] += from->bytes[i];
+        into->allocated[slot] += from->allocated[i];
+    }
+}
+
+void write_usage_table(FILE* out, const char* title, const GroupTable* t, int is_group) {
+    size_t* order;
+    size_t n = group_sorted_slots(t, 0, &order);
+    fprintf(out, "%s\tID\tEntries\tBytes\tAllocated\n", title);
+    for (size_t i = 0; i < n; i++) {
+        uint32_t id = (uint32_t)t->keys[order[i]];
+        fprintf(out, "%s\t%u\t%lu\t%lld\t%lld\n", cached_name(is_group ? &group_names : &user_names, id, is_group),
+                id, (unsigned long)t->counts[order[i]], (long long)t->bytes[order[i]],
+                (long long)t->allocated[order[i]]);
+    }
+    fprintf(out, "\n");
+    free(order);
+}
+
+// Merges and frees the per-worker tables filled by the last run_scan
+int write_usage_report(const char* filename) {
+    GroupTable users, groups, tops;
+    group_init(&users, 64);
+    group_init(&groups, 64);
+    group_init(&tops, 64);
+    for (int i = 0; i < MAX_THREADS; i++) {
+        group_merge(&users, &workers[i].users);
+        group_merge(&groups, &workers[i].groups);
+        group_merge(&tops, &workers[i].tops);
+        group_free(&workers[i].users);
+        group_free(&workers[i].groups);
+        group_free(&workers[i].tops);
+    }
+
+    FILE* out = fopen(filename, "w");
+    if (!out) {
+        perror("Failed to open usage report");
+    } else {
+        write_usage_table(out, "User", &users, 0);
+        write_usage_table(out, "Group", &groups, 1);
+
+        size_t* order;
+        size_t n = group_sorted_slots(&tops, 0, &order);
+        fprintf(out, "Directory\tUser\tEntries\tBytes\tAllocated\n");
+        for (size_t i = 0; i < n; i++) {
+            uint64_t key = tops.keys[order[i]];
+            fprintf(out, "%s\t%s\t%lu\t%lld\t%lld\n", top_names.strs[key >> 32],
+                    cached_name(&user_names, (uint32_t)key, 0),
+                    (unsigned long)tops.counts[order[i]], (long long)tops.bytes[order[i]],
+                    (long long)tops.allocated[order[i]]);
+        }
+        free(order);
+        fclose(out);
+    }
+    group_free(&users);
+    group_free(&groups);
+    group_free(&tops);
+    return out ? 0 : -1;
+}
+
+// ---------------------------------------------------------------------------
+// Query mode: loads a saved scan into columns and aggregates it in batches
+// ---------------------------------------------------------------------------
+
+enum { TYPE_DIR, TYPE_REG, TYPE_LNK, TYPE_OTHER, TYPE_COUNT };
+const char* type_names[TYPE_COUNT] = {"Directory", "Regular File", "Symbolic Link", "Other"};
+
+enum { GROUP_NONE, GROUP_DEPTH, GROUP_EXT, GROUP_TYPE, GROUP_AGE, GROUP_OWNER, GROUP_GROUP };
+
+#define AGE_BUCKETS 6
+const int64_t age_limits[AGE_BUCKETS - 1] = {86400, 7 * 86400, 30 * 86400, 90 * 86400, 365 * 86400};
+const char* age_names[AGE_BUCKETS] = {"<1d", "1d-7d", "7d-30d", "30d-90d", "90d-1y", ">1y"};
+
+// Column store for a loaded scan, one array per field
+typedef struct {
+    size_t n;
+    size_t cap;
+    char* blob;          // NUL-terminated paths, back to back
+    size_t blob_len;
+    size_t blob_cap;
+    size_t* path_off;
+    int64_t* size;
+    int64_t* mtime;
+    uint8_t* type;
+    uint16_t* depth;
+    uint32_t* uid;
+    uint32_t* gid;
+    uint32_t* ext;       // id in exts
+    StrTable exts;
+    void* map;           // Snapshot the arrays point into, or NULL
+    size_t map_len;
+} ScanColumns;
+
+// Header of the column snapshot a query keeps next to a scan file as
+// <scan_file>.cols, so later queries map the arrays instead of parsing
+// text. The columns follow in snapshot_columns order, then the path blob
+// and the NUL-terminated extension names, each padded to 8 bytes. It is a
+// cache for this machine, so fields are native-endian.
+typedef struct {
+    char magic[8];
+    uint64_t rows;
+    uint64_t blob_len;
+    uint64_t ext_count;
+    uint64_t ext_len;
+    int64_t source_size;     // Scan file the snapshot was built from
+    int64_t source_mtime_ns;
+} SnapshotHeader;
+
+#define SNAPSHOT_MAGIC "SCANCOL1"
+#define SNAPSHOT_COLUMNS 8
+
+void columns_add(ScanColumns* c, const char* path, int64_t size, int type, int64_t mtime,
+                 uint32_t uid, uint32_t gid) {
+    if (c->n == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 4096;
+        c->path_off = xrealloc(c->path_off, c->cap * sizeof(size_t));
+        c->size = xrealloc(c->size, c->cap * sizeof(int64_t));
+        c->mtime = xrealloc(c->mtime, c->cap * sizeof(int64_t));
+        c->type = xrealloc(c->type, c->cap * sizeof(uint8_t));
+        c->depth = xrealloc(c->depth, c->cap * sizeof(uint16_t));
+        c->uid = xrealloc(c->uid, c->cap * sizeof(uint32_t));
+        c->gid = xrealloc(c->gid, c->cap * sizeof(uint32_t));
+        c->ext = xrealloc(c->ext, c->cap * sizeof(uint32_t));
+    }
+    size_t len = strlen(path);
+    if (c->blob_len + len + 1 > c->blob_cap) {
+        while (c->blob_len + len + 1 > c->blob_cap) {
+            c->blob_cap = c->blob_cap ? c->blob_cap * 2 : 1 << 16;
+        }
+        c->blob = xrealloc(c->blob, c->blob_cap);
+    }
+    memcpy(c->blob + c->blob_len, path, len + 1);
+    c->path_off[c->n] = c->blob_len;
+    c->blob_len += len + 1;
+
+    uint16_t slashes = 0;
+    for (const char* p = path; *p; p++) slashes += (*p == '/');
+    const char* base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    const char* dot = strrchr(base, '.');
+    const char* ext = (dot && dot != base && type == TYPE_REG) ? dot + 1 : "";
+
+    c->size[c->n] = size;
+    c->mtime[c->n] = mtime;
+    c->type[c->n] = (uint8_t)type;
+    c->depth[c->n] = slashes;
+    c->uid[c->n] = uid;
+    c->gid[c->n] = gid;
+    c->ext[c->n] = strtab_intern(&c->exts, ext, strlen(ext));
+    c->n++;
+}
+
+// Parses the record format written by process_file. Unknown lines are skipped,
+// as are side records (e.g. extent probes) that carry no Type line.
+// Appends the records of a scan file; a manifest pulls in its shards
+int columns_parse(ScanColumns* c, const char* filename) {
+    FILE* in = fopen(filename, "r");
+    if (!in) {
+        perror("Failed to open scan file");
+        return -1;
+    }
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    char* path = NULL;
+    int64_t size = 0, mtime = 0;
+    int type = -1;
+    unsigned uid = UINT32_MAX, gid = UINT32_MAX;  // Scans predating the Owner line
+    while ((len = getline(&line, &line_cap, in)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+        if (strncmp(line, "Shard: ", 7) == 0) {
+            // Shard files are named relative to the manifest
+            const char* slash = strrchr(filename, '/');
+            int dir_len = slash ? (int)(slash - filename + 1) : 0;
+            char* shard = malloc((size_t)dir_len + (size_t)len);
+            sprintf(shard, "%.*s%s", dir_len, filename, line + 7);
+            int err = columns_parse(c, shard);
+            free(shard);
+            if (err) {
+                free(path);
+                free(line);
+                fclose(in);
+                return -1;
+            }
+        } else if (strncmp(line, "Path: ", 6) == 0) {
+            free(path);
+            path = strdup(line + 6);
+            size = 0;
+            mtime = 0;
+            type = -1;
+            uid = gid = UINT32_MAX;
+        } else if (strncmp(line, "Owner: ", 7) == 0) {
+            sscanf(line + 7, "%u:%u", &uid, &gid);
+        } else if (strncmp(line, "Size: ", 6) == 0) {
+            size = strtoll(line + 6, NULL, 10);
+        } else if (strncmp(line, "Type: ", 6) == 0) {
+            type = TYPE_OTHER;
+            for (int t = 0; t < TYPE_COUNT; t++) {
+                if (strcmp(line + 6, type_names[t]) == 0) type = t;
+            }
+        } else if (strncmp(line, "Last Modified: ", 15) == 0) {
+            struct tm tm;
+            memset(&tm, 0, sizeof(tm));
+            if (strptime(line + 15, "%a %b %d %H:%M:%S %Y", &tm)) {
+                tm.tm_isdst = -1;
+                mtime = mktime(&tm);
+            }
+        } else if (strcmp(line, "-------------------") == 0 && path && type >= 0) {
+            columns_add(c, path, size, type, mtime, uid, gid);
+            free(path);
+            path = NULL;
+        }
+    }
+    free(path);
+    free(line);
+    fclose(in);
+    return 0;
+}
+
+size_t snapshot_pad(size_t len) {
+    return (len + 7) & ~(size_t)7;
+}
+
+// Column arrays in snapshot order, with their element sizes
+void snapshot_columns(ScanColumns* c, void** cols[SNAPSHOT_COLUMNS], size_t width[SNAPSHOT_COLUMNS]) {
+    void** p[SNAPSHOT_COLUMNS] = {(void**)&c->size, (void**)&c->mtime, (void**)&c->path_off,
+                                  (void**)&c->uid, (void**)&c->gid, (void**)&c->ext,
+                                  (void**)&c->depth, (void**)&c->type};
+    size_t w[SNAPSHOT_COLUMNS] = {sizeof(int64_t), sizeof(int64_t), sizeof(size_t), sizeof(uint32_t),
+                                  sizeof(uint32_t), sizeof(uint32_t), sizeof(uint16_t), sizeof(uint8_t)};
+    memcpy(cols, p, sizeof(p));
+    memcpy(width, w, sizeof(w));
+}
+
+// Pads a section of len bytes out to the next 8-byte boundary
+int snapshot_pad_out(FILE* f, size_t len) {
+    static const char zeros[8];
+    size_t pad = snapshot_pad(len) - len;
+    return fwrite(zeros, 1, pad, f) == pad ? 0 : -1;
+}
+
+int snapshot_put(FILE* f, const void* data, size_t len) {
+    return (len == 0 || fwrite(data, 1, len, f) == len) ? snapshot_pad_out(f, len) : -1;
+}
+
+// Writes the snapshot under a temporary name and renames it into place,
+// so a concurrent query never maps a partial file
+int snapshot_write(ScanColumns* c, const char* path, const struct stat* source) {
+    char* tmp = malloc(strlen(path) + 32);
+    sprintf(tmp, "%s.%d.tmp", path, (int)getpid());
+    FILE* f = fopen(tmp, "w");
+    if (!f) {
+        free(tmp);
+        return -1;
+    }
+    SnapshotHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.rows = c->n;
+    h.blob_len = c->blob_len;
+    h.ext_count = c->exts.count;
+    for (size_t i = 0; i < c->exts.count; i++) h.ext_len += c->exts.lens[i] + 1;
+    h.source_size = source->st_size;
+    h.source_mtime_ns = (int64_t)source->st_mtim.tv_sec * 1000000000 + source->st_mtim.tv_nsec;
+
+    void** cols[SNAPSHOT_COLUMNS];
+    size_t width[SNAPSHOT_COLUMNS];
+    snapshot_columns(c, cols, width);
+    int err = snapshot_put(f, &h, sizeof(h));
+    for (int i = 0; i < SNAPSHOT_COLUMNS && !err; i++) {
+        err = snapshot_put(f, *cols[i], c->n * width[i]);
+    }
+    if (!err) err = snapshot_put(f, c->blob, c->blob_len);
+    for (size_t i = 0; i < c->exts.count && !err; i++) {
+        err = fwrite(c->exts.strs[i], 1, c->exts.lens[i] + 1, f) == c->exts.lens[i] + 1 ? 0 : -1;
+    }
+    if (!err) err = snapshot_pad_out(f, h.ext_len);
+    if (fclose(f) != 0) err = -1;
+    if (!err && rename(tmp, path) != 0) err = -1;
+    if (err) {
+        int saved = errno;
+        unlink(tmp);
+        errno = saved;
+    }
+    free(tmp);
+    return err;
+}
+
+// Maps a snapshot built from source as it is now; -1 if it is missing,
+// stale or malformed
+int snapshot_map(ScanColumns* c, const char* path, const struct stat* source) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SnapshotHeader)) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    const SnapshotHeader* h = map;
+    void** cols[SNAPSHOT_COLUMNS];
+    size_t width[SNAPSHOT_COLUMNS];
+    snapshot_columns(c, cols, width);
+    size_t need = sizeof(SnapshotHeader);
+    for (int i = 0; i < SNAPSHOT_COLUMNS; i++) need += snapshot_pad(h->rows * width[i]);
+    need += snapshot_pad(h->blob_len) + snapshot_pad(h->ext_len);
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 ||
+        h->source_size != source->st_size ||
+        h->source_mtime_ns != (int64_t)source->st_mtim.tv_sec * 1000000000 + source->st_mtim.tv_nsec ||
+        h->rows > (uint64_t)st.st_size || need != (size_t)st.st_size) {
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+
+    char* p = (char*)map + sizeof(SnapshotHeader);
+    for (int i = 0; i < SNAPSHOT_COLUMNS; i++) {
+        *cols[i] = p;
+        p += snapshot_pad(h->rows * width[i]);
+    }
+    c->blob = p;
+    p += snapshot_pad(h->blob_len);
+    // Interning in file order gives every name back its id
+    for (uint64_t i = 0; i < h->ext_count; i++) {
+        size_t len = strlen(p);
+        strtab_intern(&c->exts, p, len);
+        p += len + 1;
+    }
+    c->n = c->cap = h->rows;
+    c->blob_len = c->blob_cap = h->blob_len;
+    c->map = map;
+    c->map_len = (size_t)st.st_size;
+    return 0;
+}
+
+// Loads the scan's column snapshot, or parses the text output and writes
+// a fresh snapshot when there is none or the scan file changed since
+int columns_load(ScanColumns* c, const char* filename) {
+    struct stat source;
+    if (stat(filename, &source) != 0) {
+        perror("Failed to open scan file");
+        return -1;
+    }
+    char* snapshot = malloc(strlen(filename) + 6);
+    sprintf(snapshot, "%s.cols", filename);
+    if (snapshot_map(c, snapshot, &source) == 0) {
+        free(snapshot);
+        return 0;
+    }
+    if (columns_parse(c, filename) != 0) {
+        free(snapshot);
+        return -1;
+    }
+
+    // Depth is relative to the shallowest record, i.e. the scan root's children
+    if (c->n > 0) {
+        uint16_t min_depth = UINT16_MAX;
+        for (size_t i = 0; i < c->n; i++) {
+            if (c->depth[i] < min_depth) min_depth = c->depth[i];
+        }
+        for (size_t i = 0; i < c->n; i++) {
+            c->depth[i] = (uint16_t)(c->depth[i] - min_depth + 1);
+        }
+    }
+    if (snapshot_write(c, snapshot, &source) != 0) {
+        fprintf(stderr, "Could not write column snapshot %s: %s\n", snapshot, strerror(errno));
+    }
+    free(snapshot);
+    return 0;
+}
+
+void columns_free(ScanColumns* c) {
+    strtab_free(&c->exts);
+    if (c->map) {
+        munmap(c->map, c->map_len);
+        return;
+    }
+    free(c->blob);
+    free(c->path_off);
+    free(c->size);
+    free(c->mtime);
+    free(c->type);
+    free(c->depth);
+    free(c->uid);
+    free(c->gid);
+    free(c->ext);
+}
+
+typedef struct {
+    int group;
+    int type;            // -1 = any
+    int64_t min_size;
+    int64_t max_size;
+    int64_t min_age;     // seconds, -1 = any
+    int64_t max_age;
+    int top;
+} Query;
+
+void heap_sift_down(size_t* heap, size_t n, size_t i, const int64_t* size) {
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, m = i;
+        if (l < n && size[heap[l]] < size[heap[m]]) m = l;
+        if (r < n && size[heap[r]] < size[heap[m]]) m = r;
+        if (m == i) return;
+        size_t t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+void run_query(const ScanColumns* c, const Query* q, FILE* out) {
+    uint32_t sel[QUERY_BATCH];
+    uint64_t keys[QUERY_BATCH];
+    GroupTable groups;
+    group_init(&groups, 64);
+    size_t* heap = q->top > 0 ? malloc((size_t)q->top * sizeof(size_t)) : NULL;
+    size_t heap_n = 0;
+    uint64_t total_count = 0;
+    int64_t total_bytes = 0;
+    int64_t now = time(NULL);
+
+    for (size_t base = 0; base < c->n; base += QUERY_BATCH) {
+        size_t rows = c->n - base < QUERY_BATCH ? c->n - base : QUERY_BATCH;
+        const int64_t* size = c->size + base;
+        const int64_t* mtime = c->mtime + base;
+        const uint8_t* type = c->type + base;
+
+        // Filter: build a selection vector without branching per predicate
+        size_t n = 0;
+        for (size_t i = 0; i < rows; i++) {
+            int64_t age = now - mtime[i];
+            int keep = (q->type < 0 || type[i] == q->type) &
+                       (size[i] >= q->min_size) & (size[i] <= q->max_size) &
+                       (q->min_age < 0 || age >= q->min_age) &
+                       (q->max_age < 0 || age < q->max_age);
+            sel[n] = (uint32_t)i;
+            n += keep;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            total_bytes += size[sel[i]];
+        }
+        total_count += n;
+
+        if (q->group != GROUP_NONE) {
+            // Project the group key column for the selected rows
+            switch (q->group) {
+            case GROUP_DEPTH:
+                for (size_t i = 0; i < n; i++) keys[i] = c->depth[base + sel[i]];
+                break;
+            case GROUP_EXT:
+                for (size_t i = 0; i < n; i++) keys[i] = c->ext[base + sel[i]];
+                break;
+            case GROUP_TYPE:
+                for (size_t i = 0; i < n; i++) keys[i] = type[sel[i]];
+                break;
+            case GROUP_OWNER:
+                for (size_t i = 0; i < n; i++) keys[i] = c->uid[base + sel[i]];
+                break;
+            case GROUP_GROUP:
+                for (size_t i = 0; i < n; i++) keys[i] = c->gid[base + sel[i]];
+                break;
+            case GROUP_AGE:
+                for (size_t i = 0; i < n; i++) {
+                    int64_t age = now - mtime[sel[i]];
+                    uint64_t b = 0;
+                    while (b < AGE_BUCKETS - 1 && age >= age_limits[b]) b++;
+                    keys[i] = b;
+                }
+                break;
+            }
+            for (size_t i = 0; i < n; i++) {
+                size_t slot = group_slot(&groups, keys[i]);
+                groups.counts[slot]++;
+                groups.bytes[slot] += size[sel[i]];
+            }
+        }
+
+        // Top-k by size: min-heap of row ids
+        for (size_t i = 0; heap && i < n; i++) {
+            size_t row = base + sel[i];
+            if (heap_n < (size_t)q->top) {
+                size_t j = heap_n++;
+                while (j > 0 && c->size[heap[(j - 1) / 2]] > c->size[row]) {
+                    heap[j] = heap[(j - 1) / 2];
+                    j = (j - 1) / 2;
+                }
+                heap[j] = row;
+            } else if (c->size[row] > c->size[heap[0]]) {
+                heap[0] = row;
+                heap_sift_down(heap, heap_n, 0, c->size);
+            }
+        }
+    }
+
+    if (q->group != GROUP_NONE) {
+        size_t* order;
+        int by_key = q->group == GROUP_DEPTH || q->group == GROUP_AGE || q->group == GROUP_TYPE;
+        size_t k = group_sorted_slots(&groups, by_key, &order);
+        for (size_t i = 0; i < k; i++) {
+            uint64_t key = groups.keys[order[i]];
+            switch (q->group) {
+            case GROUP_DEPTH: fprintf(out, "%lu", (unsigned long)key); break;
+            case GROUP_EXT: fprintf(out, "%s", *c->exts.strs[key] ? c->exts.strs[key] : "(none)"); break;
+            case GROUP_TYPE: fprintf(out, "%s", type_names[key]); break;
+            case GROUP_AGE: fprintf(out, "%s", age_names[key]); break;
+            case GROUP_OWNER: fprintf(out, "%s", cached_name(&user_names, (uint32_t)key, 0)); break;
+            case GROUP_GROUP: fprintf(out, "%s", cached_name(&group_names, (uint32_t)key, 1)); break;
+            }
+            fprintf(out, "\t%lu\t%lld\n", (unsigned long)groups.counts[order[i]],
+                    (long long)groups.bytes[order[i]]);
+        }
+        free(order);
+    }
+
+    if (heap) {
+        // Pop the min-heap from the back to print largest first
+        size_t n = heap_n;
+        while (heap_n > 0) {
+            size_t t = heap[0];
+            heap[0] = heap[--heap_n];
+            heap[heap_n] = t;
+            heap_sift_down(heap, heap_n, 0, c->size);
+        }
+        for (size_t i = 0; i < n; i++) {
+            fprintf(out, "%lld\t%s\n", (long long)c->size[heap[i]], c->blob + c->path_off[heap[i]]);
+        }
+        free(heap);
+    }
+
+    if (q->group == GROUP_NONE && q->top <= 0) {
+        fprintf(out, "%lu\t%lld\n", (unsigned long)total_count, (long long)total_bytes);
+    }
+    group_free(&groups);
+}
+
+int query_main(int argc, char* argv[]) {
+    const char* usage =
+        "Usage: %s query <scan_file> [-g depth|ext|type|age|owner|group] [-t d|f|l|o]\n"
+        "       [-s min_size] [-S max_size] [-a min_age_days] [-A max_age_days] [-k top]\n";
+    Query q = {GROUP_NONE, -1, 0, INT64_MAX, -1, -1, 0};
+    int opt;
+    while ((opt = getopt(argc, argv, "g:t:s:S:a:A:k:")) != -1) {
+        switch (opt) {
+        case 'g':
+            if (strcmp(optarg, "depth") == 0) q.group = GROUP_DEPTH;
+            else if (strcmp(optarg, "ext") == 0) q.group = GROUP_EXT;
+            else if (strcmp(optarg, "type") == 0) q.group = GROUP_TYPE;
+            else if (strcmp(optarg, "age") == 0) q.group = GROUP_AGE;
+            else if (strcmp(optarg, "owner") == 0) q.group = GROUP_OWNER;
+            else if (strcmp(optarg, "group") == 0) q.group = GROUP_GROUP;
+            else {
+                fprintf(stderr, "Unknown group: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 't':
+            q.type = optarg[0] == 'd' ? TYPE_DIR : optarg[0] == 'f' ? TYPE_REG :
+                     optarg[0] == 'l' ? TYPE_LNK : TYPE_OTHER;
+            break;
+        case 's': q.min_size = strtoll(optarg, NULL, 10); break;
+        case 'S': q.max_size = strtoll(optarg, NULL, 10); break;
+        case 'a': q.min_age = strtoll(optarg, NULL, 10) * 86400; break;
+        case 'A': q.max_age = strtoll(optarg, NULL, 10) * 86400; break;
+        case 'k': q.top = atoi(optarg); break;
+        default:
+            fprintf(stderr, usage, "scanner");
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, usage, "scanner");
+        return 1;
+    }
+
+    ScanColumns cols;
+    memset(&cols, 0, sizeof(cols));
+    if (columns_load(&cols, argv[optind]) != 0) {
+        return 1;
+    }
+    run_query(&cols, &q, stdout);
+    columns_free(&cols);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Daemon mode: serves an in-memory index over a Unix domain socket
+// ---------------------------------------------------------------------------
+
+// Requests are an 8-byte header followed by arg_len bytes of argument.
+// Responses are a status/count header followed by count records.
+enum { REQ_LIST = 1, REQ_TOTAL = 2, REQ_SEARCH = 3 };
+
+typedef struct {
+    uint8_t op;
+    uint8_t flags;
+    uint16_t arg_len;
+    uint32_t limit;      // Max records returned, 0 = no limit
+} Request;
+
+typedef struct {
+    uint32_t status;     // 0 or an errno value
+    uint32_t count;
+} ResponseHeader;
+
+// Record: u64 size, u32 mode, i64 mtime, u16 path_len, path bytes
+#define RECORD_HEADER_SIZE 22
+#define CONN_READ_SIZE 4096
+
+typedef struct {
+    int fd;
+    char* in;
+    size_t in_len;
+    size_t in_cap;
+    char* out;
+    size_t out_len;
+    size_t out_off;
+    size_t out_cap;
+    uint32_t events;     // Registered with epoll
+    int metrics;         // Accepted on the metrics listener
+    int closing;         // Close once out is flushed
+    int eof;             // Peer has shut down its side; in holds all it sent
+} Conn;
+
+ScanIndex* ready_index;   // Handed from the indexer thread to the event loop
+pthread_mutex_t ready_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void index_free(ScanIndex* index) {
+    if (!index) return;
+    for (size_t i = 0; i < index->count; i++) free(index->entries[i].path);
+    free(index->entries);
+    pthread_mutex_destroy(&index->mutex);
+    free(index);
+}
+
+int compare_index_entries(const void* a, const void* b) {
+    return strcmp(((const IndexEntry*)a)->path, ((const IndexEntry*)b)->path);
+}
+
+// First entry whose path sorts at or after key
+size_t index_lower_bound(const ScanIndex* index, const char* key) {
+    size_t lo = 0, hi = index->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(index->entries[mid].path, key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+void run_scan(const char* root) {
+    scan_root = root;
+    if (follow_links) {
+        visited_init();
+        struct stat st;
+        if (stat(root, &st) == 0) {
+            visited_insert(st.st_dev, st.st_ino);
+        }
+    }
+    fd_budget_init();
+    queue_init(&work_queue);
+    work_queue.window = queue_window;
+#ifdef LOCKFREE_QUEUE
+    // In bounded mode the ring is the window, rounded up to a power of two
+    size_t ring_size = LF_RING_SIZE;
+    if (queue_window > 0) {
+        for (ring_size = 2; ring_size < (size_t)queue_window; ring_size *= 2) {}
+    }
+    lf_init(&work_queue, ring_size);
+#endif
+    if (queue_window > 0 && queue_window > work_queue.capacity) {
+        work_queue.items = xrealloc(work_queue.items, (size_t)queue_window * sizeof(DirNode*));
+        work_queue.capacity = queue_window;
+    }
+    work_queue.root = node_new(NULL, root, strlen(root));
+    atomic_fetch_add(&work_queue.root->refs, 1);  // Pinned for spill reloads
+    queue_push(&work_queue, work_queue.root);
+
+    atomic_store(&async_statx_ring, 0);
+    atomic_store(&async_statx_sync, 0);
+    atomic_store(&async_peak_visits, 0);
+    atomic_store(&async_active_visits, 0);
+    int nthreads = async_engine ? ASYNC_THREADS : MAX_THREADS;
+    void* (*engine)(void*) = async_engine ? async_worker_thread : worker_thread;
+
+    int started = 0;
+    for (int i = 0; i < MAX_THREADS; i++) {
+        memset(&workers[i], 0, sizeof(WorkerState));
+        workers[i].id = i;
+        if (accounting) {
+            group_init(&workers[i].users, 64);
+            group_init(&workers[i].groups, 64);
+            group_init(&workers[i].tops, 64);
+        }
+        if (i >= nthreads) {
+            continue;
+        }
+        if (pthread_create(&thread_pool[i], NULL, engine, &workers[i]) != 0) {
+            fprintf(stderr, "Failed to create thread %d\n", i);
+            if (started == 0) running = 0;
+            break;
+        }
+        started++;
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(thread_pool[i], NULL);
+        free(workers[i].xattr_names);
+        free(workers[i].xattr_value);
+        free(workers[i].xattr_text);
+        free(workers[i].xattr_ids);
+        free(workers[i].path);
+    }
+
+    if (work_queue.spill.total > 0) {
+        printf("Spilled %ld directories to disk\n", work_queue.spill.total);
+    }
+    printf("Idle worker parks: %ld\n", atomic_load(&work_queue.parker.parks));
+    if (async_engine) {
+        printf("Async engine: %ld statx via io_uring, %ld synchronous, peak %d directories in flight\n",
+               atomic_load(&async_statx_ring), atomic_load(&async_statx_sync),
+               atomic_load(&async_peak_visits));
+    }
+    node_release(work_queue.root);
+    queue_destroy(&work_queue);
+    if (follow_links) {
+        visited_destroy();
+    }
+}
+
+typedef struct {
+    const char* root;
+    int notify_fd;
+} IndexerArgs;
+
+void* indexer_thread(void* arg) {
+    IndexerArgs* args = arg;
+    ScanIndex* index = calloc(1, sizeof(ScanIndex));
+    pthread_mutex_init(&index->mutex, NULL);
+
+    atomic_store(&scan_in_progress, 1);
+    uint64_t start = now_ns();
+    scan_index = index;
+    run_scan(args->root);
+    scan_index = NULL;
+    atomic_store(&last_scan_ns, (long)(now_ns() - start));
+    atomic_store(&last_scan_entries, (long)index->count);
+    atomic_fetch_add(&scans_completed, 1);
+    atomic_store(&scan_in_progress, 0);
+    qsort(index->entries, index->count, sizeof(IndexEntry), compare_index_entries);
+
+    pthread_mutex_lock(&ready_mutex);
+    index_free(ready_index);
+    ready_index = index;
+    pthread_mutex_unlock(&ready_mutex);
+
+    uint64_t one = 1;
+    if (write(args->notify_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("eventfd write");
+    }
+    return NULL;
+}
+
+void conn_reserve(char** buf, size_t* cap, size_t need) {
+    if (need <= *cap) return;
+    size_t cap2 = *cap ? *cap : 4096;
+    while (cap2 < need) cap2 *= 2;
+    *buf = xrealloc(*buf, cap2);
+    *cap = cap2;
+}
+
+void conn_put(Conn* c, const void* data, size_t len) {
+    conn_reserve(&c->out, &c->out_cap, c->out_len + len);
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+void conn_put_entry(Conn* c, const IndexEntry* e) {
+    char rec[RECORD_HEADER_SIZE];
+    uint64_t size = (uint64_t)e->size;
+    uint32_t mode = (uint32_t)e->mode;
+    int64_t mtime = (int64_t)e->mtime;
+    size_t len = strlen(e->path);
+    uint16_t path_len = len > UINT16_MAX ? UINT16_MAX : (uint16_t)len;
+    memcpy(rec, &size, 8);
+    memcpy(rec + 8, &mode, 4);
+    memcpy(rec + 12, &mtime, 8);
+    memcpy(rec + 20, &path_len, 2);
+    conn_put(c, rec, sizeof(rec));
+    conn_put(c, e->path, path_len);
+}
+
+// Appends the response header, reserving its slot so the count can be patched in
+size_t conn_begin_response(Conn* c, uint32_t status) {
+    ResponseHeader h = {status, 0};
+    size_t at = c->out_len;
+    conn_put(c, &h, sizeof(h));
+    return at;
+}
+
+void conn_end_response(Conn* c, size_t at, uint32_t count) {
+    memcpy(c->out + at + offsetof(ResponseHeader, count), &count, sizeof(count));
+}
+
+void handle_request(Conn* c, const Request* req, char* arg, const ScanIndex* index) {
+    if (!index) {
+        conn_begin_response(c, EAGAIN);  // First scan still running
+        return;
+    }
+
+    uint32_t limit = req->limit ? req->limit : UINT32_MAX;
+    uint32_t count = 0;
+    size_t at;
+    switch (req->op) {
+    case REQ_LIST: {
+        at = conn_begin_response(c, 0);
+        size_t len = strlen(arg);
+        for (size_t i = index_lower_bound(index, arg);
+             i < index->count && count < limit && strncmp(index->entries[i].path, arg, len) == 0; i++) {
+            conn_put_entry(c, &index->entries[i]);
+            count++;
+        }
+        conn_end_response(c, at, count);
+        break;
+    }
+    case REQ_TOTAL: {
+        // Subtree = the entry itself plus everything under "<arg>/"
+        size_t len = strlen(arg);
+        while (len > 1 && arg[len - 1] == '/') arg[--len] = '\0';
+        uint64_t totals[2] = {0, 0};  // entries, bytes
+        size_t i = index_lower_bound(index, arg);
+        if (i < index->count && strcmp(index->entries[i].path, arg) == 0) {
+            totals[0]++;
+            totals[1] += (uint64_t)index->entries[i].size;
+            i++;
+        }
+        for (; i < index->count && strncmp(index->entries[i].path, arg, len) == 0; i++) {
+            if (index->entries[i].path[len] != '/') continue;
+            totals[0]++;
+            totals[1] += (uint64_t)index->entries[i].size;
+        }
+        at = conn_begin_response(c, 0);
+        conn_put(c, totals, sizeof(totals));
+        conn_end_response(c, at, 1);
+        break;
+    }
+    case REQ_SEARCH:
+        at = conn_begin_response(c, 0);
+        for (size_t i = 0; i < index->count && count < limit; i++) {
+            const char* base = strrchr(index->entries[i].path, '/');
+            base = base ? base + 1 : index->entries[i].path;
+            if (strstr(base, arg)) {
+                conn_put_entry(c, &index->entries[i]);
+                count++;
+            }
+        }
+        conn_end_response(c, at, count);
+        break;
+    default:
+        conn_begin_response(c, EINVAL);
+        break;
+    }
+}
+
+void conn_close(int epfd, Conn* c) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+// Returns -1 if the connection should be closed
+int conn_flush(int epfd, Conn* c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+            return -1;
+        }
+        c->out_off += (size_t)n;
+    }
+    if (c->out_off == c->out_len) {
+        c->out_off = c->out_len = 0;
+    }
+    // A peer at end of stream stays readable, so stop polling for input
+    uint32_t events = (c->eof ? 0 : EPOLLIN) | (c->out_len > 0 ? EPOLLOUT : 0);
+    if (events != c->events) {
+        struct epoll_event ev = {.events = events, .data.ptr = c};
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = events;
+    }
+    return 0;
+}
+
+// Reads everything available, noting end of stream in c->eof so requests
+// that arrived with it are still answered; -1 on error
+int conn_fill(Conn* c) {
+    while (!c->eof) {
+        conn_reserve(&c->in, &c->in_cap, c->in_len + CONN_READ_SIZE);
+        ssize_t n = read(c->fd, c->in + c->in_len, CONN_READ_SIZE);
+        if (n == 0) {
+            c->eof = 1;
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return 0;
+            return -1;
+        }
+        c->in_len += (size_t)n;
+    }
+    return 0;
+}
+
+// Answers every complete request; -1 once the peer has shut down, after
+// the replies are queued for the final flush
+int conn_read(Conn* c, const ScanIndex* index) {
+    if (conn_fill(c) != 0) {
+        return -1;
+    }
+
+    size_t off = 0;
+    while (c->in_len - off >= sizeof(Request)) {
+        Request req;
+        memcpy(&req, c->in + off, sizeof(req));
+        if (c->in_len - off < sizeof(req) + req.arg_len) break;
+        char* arg = malloc((size_t)req.arg_len + 1);
+        memcpy(arg, c->in + off + sizeof(req), req.arg_len);
+        arg[req.arg_len] = '\0';
+        handle_request(c, &req, arg, index);
+        free(arg);
+        off += sizeof(req) + req.arg_len;
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    return c->eof ? -1 : 0;
+}
+
+void conn_printf(Conn* c, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    conn_reserve(&c->out, &c->out_cap, c->out_len + (size_t)n + 1);
+    va_start(ap, fmt);
+    vsnprintf(c->out + c->out_len, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    c->out_len += (size_t)n;
+}
+
+void metrics_header(Conn* c, const char* name, const char* type, const char* help) {
+    conn_printf(c, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Renders the Prometheus text exposition of the scan threads' counters
+void metrics_render(Conn* c, const ScanIndex* index) {
+    long entries = 0, stat_ns = 0;
+    long hist[STAT_BUCKETS + 1] = {0};
+    for (int t = 0; t < METRIC_SLOTS; t++) {
+        ThreadMetrics* m = &thread_metrics_slots[t];
+        entries += atomic_load_explicit(&m->entries, memory_order_relaxed);
+        stat_ns += atomic_load_explicit(&m->stat_ns, memory_order_relaxed);
+        for (int b = 0; b <= STAT_BUCKETS; b++) {
+            hist[b] += atomic_load_explicit(&m->stat_hist[b], memory_order_relaxed);
+        }
+    }
+    long last_entries = atomic_load(&last_scan_entries);
+    double last_seconds = (double)atomic_load(&last_scan_ns) / 1e9;
+
+    metrics_header(c, "scanner_entries_total", "counter", "Entries recorded by all scans.");
+    conn_printf(c, "scanner_entries_total %ld\n", entries);
+    metrics_header(c, "scanner_scans_total", "counter", "Scans completed.");
+    conn_printf(c, "scanner_scans_total %ld\n", atomic_load(&scans_completed));
+    metrics_header(c, "scanner_scan_running", "gauge", "1 while a scan is in progress.");
+    conn_printf(c, "scanner_scan_running %d\n", atomic_load(&scan_in_progress));
+    metrics_header(c, "scanner_queue_depth", "gauge", "Directories waiting in the work queue.");
+    conn_printf(c, "scanner_queue_depth %ld\n", queue_depth(&work_queue));
+    metrics_header(c, "scanner_last_scan_entries", "gauge", "Entries found by the last completed scan.");
+    conn_printf(c, "scanner_last_scan_entries %ld\n", last_entries);
+    metrics_header(c, "scanner_last_scan_duration_seconds", "gauge", "Wall time of the last completed scan.");
+    conn_printf(c, "scanner_last_scan_duration_seconds %.6f\n", last_seconds);
+    metrics_header(c, "scanner_last_scan_entries_per_second", "gauge", "Throughput of the last completed scan.");
+    conn_printf(c, "scanner_last_scan_entries_per_second %.1f\n",
+                last_seconds > 0 ? (double)last_entries / last_seconds : 0.0);
+    metrics_header(c, "scanner_index_entries", "gauge", "Entries in the index being served.");
+    conn_printf(c, "scanner_index_entries %zu\n", index ? index->count : (size_t)0);
+
+    metrics_header(c, "scanner_stat_latency_seconds", "histogram", "Latency of synchronous stat calls.");
+    long cumulative = 0;
+    for (int b = 0; b < STAT_BUCKETS; b++) {
+        cumulative += hist[b];
+        conn_printf(c, "scanner_stat_latency_seconds_bucket{le=\"%g\"} %ld\n", stat_bounds[b], cumulative);
+    }
+    cumulative += hist[STAT_BUCKETS];
+    conn_printf(c, "scanner_stat_latency_seconds_bucket{le=\"+Inf\"} %ld\n", cumulative);
+    conn_printf(c, "scanner_stat_latency_seconds_sum %.9f\n", (double)stat_ns / 1e9);
+    conn_printf(c, "scanner_stat_latency_seconds_count %ld\n", cumulative);
+
+    metrics_header(c, "scanner_errors_total", "counter", "Failed scan operations by errno.");
+    for (int op = 0; op < OPS; op++) {
+        for (int e = 1; e < METRIC_ERRNOS; e++) {
+            long n = errors_total(op, e);
+            if (n == 0) {
+                continue;
+            }
+            const char* name = e < METRIC_ERRNOS - 1 ? strerrorname_np(e) : NULL;
+            if (name) {
+                conn_printf(c, "scanner_errors_total{op=\"%s\",errno=\"%s\"} %ld\n", op_names[op], name, n);
+            } else {
+                conn_printf(c, "scanner_errors_total{op=\"%s\",errno=\"%d\"} %ld\n", op_names[op], e, n);
+            }
+        }
+    }
+
+    metrics_header(c, "scanner_throttle_wait_seconds_total", "counter",
+                   "Time spent sleeping to stay within -R rate limits.");
+    conn_printf(c, "scanner_throttle_wait_seconds_total{budget=\"metadata\"} %.6f\n",
+                (double)atomic_load(&metadata_bucket.wait_ns) / 1e9);
+    conn_printf(c, "scanner_throttle_wait_seconds_total{budget=\"read\"} %.6f\n",
+                (double)atomic_load(&read_bucket.wait_ns) / 1e9);
+}
+
+// Answers one HTTP request with the metrics, then closes. Any request
+// line is accepted, so plain curl and Prometheus scrapes both work.
+int metrics_read(Conn* c, const ScanIndex* index) {
+    int eof = conn_fill(c) != 0 || c->eof;
+    if (c->closing) {
+        return 0;
+    }
+    conn_reserve(&c->in, &c->in_cap, c->in_len + 1);
+    c->in[c->in_len] = '\0';
+    if (!strstr(c->in, "\r\n\r\n") && !strstr(c->in, "\n\n")) {
+        return eof ? -1 : 0;
+    }
+    conn_printf(c, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                   "Connection: close\r\n\r\n");
+    metrics_render(c, index);
+    c->closing = 1;
+    return 0;
+}
+
+// Listens on a loopback (or given) IPv4 address for metrics scrapes
+int open_tcp_listener(const char* spec) {
+    const char* colon = strrchr(spec, ':');
+    char host[64] = "127.0.0.1";
+    if (colon > spec && (size_t)(colon - spec) < sizeof(host)) {
+        memcpy(host, spec, (size_t)(colon - spec));
+        host[colon - spec] = '\0';
+    }
+    char* end;
+    long port = strtol(colon + 1, &end, 10);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (*end || port < 1 || port > 65535 || inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Bad metrics address: %s\n", spec);
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        perror("Failed to listen for metrics");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int open_listener(const char* socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        perror("Failed to listen on socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int serve_main(int argc, char* argv[]) {
+    int interval = 0;  // Seconds between rescans, 0 = scan once
+    const char* metrics_spec = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:m:R:I:")) != -1) {
+        switch (opt) {
+        case 'i': interval = atoi(optarg); break;
+        case 'm': metrics_spec = optarg; break;
+        case 'R':
+            if (throttle_parse(optarg) != 0) return 1;
+            break;
+        case 'I':
+            if (stage_priority_parse(optarg) != 0) return 1;
+            break;
+        default:
+            optind = argc;  // Force the usage message
+            break;
+        }
+    }
+    if (optind != argc - 2) {
+        fprintf(stderr, "Usage: scanner serve [-i rescan_seconds] [-m metrics_socket|host:port]\n"
+                        "                     [-R ops[:bytes]] [-I stage=[class][:nice],...]\n"
+                        "                     <directory> <socket_path>\n");
+        return 1;
+    }
+    const char* socket_path = argv[optind + 1];
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;  // No SA_RESTART so epoll_wait returns EINTR
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = open_listener(socket_path);
+    if (listen_fd < 0) return 1;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    int notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &listen_fd};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.ptr = &notify_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, notify_fd, &ev);
+
+    // Metrics go to a Unix socket path, or to host:port over TCP
+    int metrics_fd = -1;
+    int metrics_unix = 0;
+    if (metrics_spec) {
+        metrics_unix = strchr(metrics_spec, '/') || !strchr(metrics_spec, ':');
+        metrics_fd = metrics_unix ? open_listener(metrics_spec) : open_tcp_listener(metrics_spec);
+        if (metrics_fd < 0) {
+            close(listen_fd);
+            unlink(socket_path);
+            return 1;
+        }
+        metrics_enabled = 1;
+        ev.data.ptr = &metrics_fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, metrics_fd, &ev);
+    }
+
+    IndexerArgs args = {argv[optind], notify_fd};
+    pthread_t indexer;
+    int indexing = pthread_create(&indexer, NULL, indexer_thread, &args) == 0;
+    ScanIndex* index = NULL;
+    time_t next_scan = 0;
+
+    struct epoll_event events[64];
+    while (running) {
+        int timeout = -1;
+        if (!indexing && interval > 0) {
+            time_t now = time(NULL);
+            timeout = next_scan > now ? (int)(next_scan - now) * 1000 : 0;
+        }
+        int n = epoll_wait(epfd, events, 64, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void* ptr = events[i].data.ptr;
+            if (ptr == &listen_fd || ptr == &metrics_fd) {
+                int lfd = *(int*)ptr;
+                int fd;
+                while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    Conn* c = calloc(1, sizeof(Conn));
+                    c->fd = fd;
+                    c->metrics = ptr == &metrics_fd;
+                    c->events = EPOLLIN;
+                    struct epoll_event cev = {.events = c->events, .data.ptr = c};
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &cev);
+                }
+            } else if (ptr == &notify_fd) {
+                // A scan finished: swap in the new index
+                uint64_t value;
+                if (read(notify_fd, &value, sizeof(value)) < 0) continue;
+                pthread_join(indexer, NULL);
+                indexing = 0;
+                pthread_mutex_lock(&ready_mutex);
+                if (ready_index) {
+                    index_free(index);
+                    index = ready_index;
+                    ready_index = NULL;
+                }
+                pthread_mutex_unlock(&ready_mutex);
+                printf("Index ready: %zu entries\n", index ? index->count : (size_t)0);
+                fflush(stdout);
+                next_scan = time(NULL) + interval;
+            } else {
+                Conn* c = ptr;
+                int fail = 0;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    fail = (c->metrics ? metrics_read(c, index) : conn_read(c, index)) != 0;
+                }
+                // Flush what was produced even if the peer has half-closed
+                if (conn_flush(epfd, c) != 0 || ((fail || c->closing || c->eof) && c->out_len == 0)) {
+                    conn_close(epfd, c);
+                }
+            }
+        }
+
+        if (running && !indexing && interval > 0 && time(NULL) >= next_scan) {
+            indexing = pthread_create(&indexer, NULL, indexer_thread, &args) == 0;
+        }
+    }
+
+    if (indexing) {
+        pthread_join(indexer, NULL);
+    }
+    index_free(index);
+    index_free(ready_index);
+    close(listen_fd);
+    close(notify_fd);
+    close(epfd);
+    unlink(socket_path);
+    if (metrics_fd >= 0) {
+        close(metrics_fd);
+        if (metrics_unix) unlink(metrics_spec);
+    }
+    return 0;
+}
+
+// Minimal client for the serve protocol, printing records as text
+int client_main(int argc, char* argv[]) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: scanner client <socket_path> list|total|search <arg> [limit]\n");
+        return 1;
+    }
+    Request req = {0, 0, 0, argc > 4 ? (uint32_t)strtoul(argv[4], NULL, 10) : 0};
+    if (strcmp(argv[2], "list") == 0) req.op = REQ_LIST;
+    else if (strcmp(argv[2], "total") == 0) req.op = REQ_TOTAL;
+    else if (strcmp(argv[2], "search") == 0) req.op = REQ_SEARCH;
+    else {
+        fprintf(stderr, "Unknown request: %s\n", argv[2]);
+        return 1;
+    }
+    size_t arg_len = strlen(argv[3]);
+    if (arg_len > UINT16_MAX) {
+        fprintf(stderr, "Argument too long\n");
+        return 1;
+    }
+    req.arg_len = (uint16_t)arg_len;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        perror("Failed to connect");
+        return 1;
+    }
+    FILE* sock = fdopen(fd, "r+");
+    fwrite(&req, sizeof(req), 1, sock);
+    fwrite(argv[3], 1, arg_len, sock);
+    fflush(sock);
+
+    ResponseHeader h;
+    if (fread(&h, sizeof(h), 1, sock) != 1) {
+        fprintf(stderr, "Connection closed\n");
+        return 1;
+    }
+    if (h.status != 0) {
+        fprintf(stderr, "Request failed: %s\n", strerror((int)h.status));
+        return 1;
+    }
+    if (req.op == REQ_TOTAL) {
+        uint64_t totals[2];
+        if (fread(totals, sizeof(totals), 1, sock) != 1) return 1;
+        printf("%lu entries\t%lu bytes\n", (unsigned long)totals[0], (unsigned long)totals[1]);
+    }
+    for (uint32_t i = 0; req.op != REQ_TOTAL && i < h.count; i++) {
+        char rec[RECORD_HEADER_SIZE];
+        char path[UINT16_MAX + 1];
+        uint64_t size;
+        uint16_t path_len;
+        if (fread(rec, sizeof(rec), 1, sock) != 1) return 1;
+        memcpy(&size, rec, 8);
+        memcpy(&path_len, rec + 20, 2);
+        if (fread(path, 1, path_len, sock) != path_len) return 1;
+        path[path_len] = '\0';
+        printf("%lu\t%s\n", (unsigned long)size, path);
+    }
+    fclose(sock);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Filename search: trigram index over basenames with varint posting lists
+// ---------------------------------------------------------------------------
+
+#define TRIGRAM_MAGIC "SCANTRI1"
+#define TRIGRAM_SPACE (1u << 24)
+
+typedef struct {
+    char magic[8];
+    uint64_t n_paths;
+    uint64_t n_trigrams;
+    uint64_t path_offsets;   // u64[n_paths + 1] into the path blob
+    uint64_t path_blob;
+    uint64_t table;          // TrigramEntry[n_trigrams], sorted by trigram
+    uint64_t postings;       // Delta + varint encoded path ids
+    uint64_t file_size;
+} TrigramHeader;
+
+typedef struct {
+    uint32_t trigram;
+    uint32_t count;
+    uint64_t offset;         // Relative to postings
+} TrigramEntry;
+
+const char* path_basename(const char* path) {
+    const char* base = strrchr(path, '/');
+    return base ? base + 1 : path;
+}
+
+// Distinct trigrams of s, sorted. out must hold len entries.
+size_t extract_trigrams(const char* s, size_t len, uint32_t* out) {
+    size_t n = 0;
+    for (size_t i = 0; i + 3 <= len; i++) {
+        const unsigned char* p = (const unsigned char*)s + i;
+        out[n++] = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+    }
+    for (size_t i = 1; i < n; i++) {  // Names are short: insertion sort
+        uint32_t v = out[i];
+        size_t j = i;
+        while (j > 0 && out[j - 1] > v) {
+            out[j] = out[j - 1];
+            j--;
+        }
+        out[j] = v;
+    }
+    size_t unique = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (unique == 0 || out[unique - 1] != out[i]) out[unique++] = out[i];
+    }
+    return unique;
+}
+
+size_t varint_put(uint8_t* out, uint32_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+const uint8_t* varint_get(const uint8_t* p, uint32_t* v) {
+    uint32_t result = 0;
+    int shift = 0;
+    while (*p & 0x80) {
+        result |= (uint32_t)(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    *v = result | (uint32_t)*p++ << shift;
+    return p;
+}
+
+int write_all(FILE* out, const void* data, size_t len) {
+    return fwrite(data, 1, len, out) == len ? 0 : -1;
+}
+
+int write_padding(FILE* out, uint64_t* pos, size_t align) {
+    static const char zeros[8];
+    size_t pad = (align - *pos % align) % align;
+    *pos += pad;
+    return write_all(out, zeros, pad);
+}
+
+// Writes the index for a path-sorted ScanIndex. Path ids are positions in it.
+int trigram_index_write(const ScanIndex* index, const char* filename) {
+    if (index->count > UINT32_MAX) {
+        fprintf(stderr, "Too many paths for trigram index\n");
+        return -1;
+    }
+    uint32_t* counts = calloc(TRIGRAM_SPACE, sizeof(uint32_t));
+    uint32_t* tris = NULL;
+    size_t tris_cap = 0;
+    if (!counts) {
+        perror("calloc");
+        return -1;
+    }
+
+    // Pass 1: posting list lengths
+    uint64_t total = 0;
+    for (size_t id = 0; id < index->count; id++) {
+        const char* base = path_basename(index->entries[id].path);
+        size_t len = strlen(base);
+        if (len > tris_cap) {
+            tris_cap = len * 2;
+            tris = xrealloc(tris, tris_cap * sizeof(uint32_t));
+        }
+        size_t n = extract_trigrams(base, len, tris);
+        for (size_t i = 0; i < n; i++) counts[tris[i]]++;
+        total += n;
+    }
+
+    // Pass 2: scatter ids into per-trigram slices, in id order
+    uint64_t* starts = malloc(((size_t)TRIGRAM_SPACE + 1) * sizeof(uint64_t));
+    uint32_t* ids = malloc((total ? total : 1) * sizeof(uint32_t));
+    if (!starts || !ids) {
+        perror("malloc");
+        free(counts);
+        free(starts);
+        free(ids);
+        free(tris);
+        return -1;
+    }
+    uint64_t n_trigrams = 0;
+    starts[0] = 0;
+    for (uint32_t t = 0; t < TRIGRAM_SPACE; t++) {
+        starts[t + 1] = starts[t] + counts[t];
+        n_trigrams += counts[t] != 0;
+        counts[t] = 0;  // Reused as fill cursor
+    }
+    for (size_t id = 0; id < index->count; id++) {
+        const char* base = path_basename(index->entries[id].path);
+        size_t n = extract_trigrams(base, strlen(base), tris);
+        for (size_t i = 0; i < n; i++) {
+            ids[starts[tris[i]] + counts[tris[i]]++] = (uint32_t)id;
+        }
+    }
+    free(tris);
+
+    FILE* out = fopen(filename, "wb");
+    if (!out) {
+        perror("Failed to open index file");
+        free(counts);
+        free(starts);
+        free(ids);
+        return -1;
+    }
+    TrigramHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TRIGRAM_MAGIC, sizeof(h.magic));
+    h.n_paths = index->count;
+    h.n_trigrams = n_trigrams;
+    int err = write_all(out, &h, sizeof(h));
+    uint64_t pos = sizeof(h);
+
+    h.path_offsets = pos;
+    uint64_t off = 0;
+    for (size_t id = 0; id <= index->count && !err; id++) {
+        err = write_all(out, &off, sizeof(off));
+        if (id < index->count) off += strlen(index->entries[id].path) + 1;
+    }
+    pos += (index->count + 1) * sizeof(uint64_t);
+    h.path_blob = pos;
+    for (size_t id = 0; id < index->count && !err; id++) {
+        err = write_all(out, index->entries[id].path, strlen(index->entries[id].path) + 1);
+    }
+    pos += off;
+    err = err || write_padding(out, &pos, 8);
+
+    // Table entries carry the encoded offset, so size the postings first
+    h.table = pos;
+    uint8_t buf[5];
+    uint64_t postings_len = 0;
+    for (uint32_t t = 0; t < TRIGRAM_SPACE && !err; t++) {
+        if (!counts[t]) continue;
+        TrigramEntry e = {t, counts[t], postings_len};
+        uint32_t prev = 0;
+        for (uint64_t i = starts[t]; i < starts[t + 1]; i++) {
+            postings_len += varint_put(buf, ids[i] - prev);
+            prev = ids[i];
+        }
+        err = write_all(out, &e, sizeof(e));
+    }
+    pos += n_trigrams * sizeof(TrigramEntry);
+    h.postings = pos;
+    for (uint32_t t = 0; t < TRIGRAM_SPACE && !err; t++) {
+        uint32_t prev = 0;
+        for (uint64_t i = starts[t]; i < starts[t + 1] && !err; i++) {
+            err = write_all(out, buf, varint_put(buf, ids[i] - prev));
+            prev = ids[i];
+        }
+    }
+    pos += postings_len;
+    h.file_size = pos;
+
+    err = err || fseek(out, 0, SEEK_SET) != 0 || write_all(out, &h, sizeof(h));
+    if (fclose(out) != 0) err = -1;
+    if (err) {
+        perror("Failed to write index file");
+    }
+    free(counts);
+    free(starts);
+    free(ids);
+    return err ? -1 : 0;
+}
+
+typedef struct {
+    const uint8_t* base;
+    size_t size;
+    const TrigramHeader* header;
+    const uint64_t* path_offsets;
+    const char* paths;
+    const TrigramEntry* table;
+    const uint8_t* postings;
+} TrigramIndex;
+
+int trigram_index_open(TrigramIndex* ti, const char* filename) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("Failed to open index file");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TrigramHeader)) {
+        fprintf(stderr, "Invalid index file: %s\n", filename);
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    ti->base = map;
+    ti->size = (size_t)st.st_size;
+    ti->header = map;
+    if (memcmp(ti->header->magic, TRIGRAM_MAGIC, 8) != 0 || ti->header->file_size != ti->size) {
+        fprintf(stderr, "Invalid index file: %s\n", filename);
+        munmap(map, ti->size);
+        return -1;
+    }
+    ti->path_offsets = (const uint64_t*)(ti->base + ti->header->path_offsets);
+    ti->paths = (const char*)ti->base + ti->header->path_blob;
+    ti->table = (const TrigramEntry*)(ti->base + ti->header->table);
+    ti->postings = ti->base + ti->header->postings;
+    return 0;
+}
+
+const TrigramEntry* trigram_lookup(const TrigramIndex* ti, uint32_t trigram) {
+    size_t lo = 0, hi = ti->header->n_trigrams;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ti->table[mid].trigram < trigram) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < ti->header->n_trigrams && ti->table[lo].trigram == trigram ? &ti->table[lo] : NULL;
+}
+
+int compare_trigram_counts(const void* a, const void* b) {
+    const TrigramEntry* x = *(const TrigramEntry* const*)a;
+    const TrigramEntry* y = *(const TrigramEntry* const*)b;
+    return (x->count > y->count) - (x->count < y->count);
+}
+
+// Candidate ids whose basenames contain every trigram of the needle
+size_t trigram_candidates(const TrigramIndex* ti, const char* needle, uint32_t** out) {
+    size_t len = strlen(needle);
+    uint32_t* tris = malloc(len * sizeof(uint32_t));
+    size_t n = extract_trigrams(needle, len, tris);
+    const TrigramEntry** lists = malloc(n * sizeof(TrigramEntry*));
+    for (size_t i = 0; i < n; i++) {
+        lists[i] = trigram_lookup(ti, tris[i]);
+        if (!lists[i]) {
+            free(tris);
+            free(lists);
+            *out = NULL;
+            return 0;
+        }
+    }
+    free(tris);
+    qsort(lists, n, sizeof(TrigramEntry*), compare_trigram_counts);
+
+    // Decode the shortest list, then intersect the rest into it in place
+    uint32_t* ids = malloc(lists[0]->count * sizeof(uint32_t));
+    size_t count = lists[0]->count;
+    const uint8_t* p = ti->postings + lists[0]->offset;
+    uint32_t id = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t delta;
+        p = varint_get(p, &delta);
+        ids[i] = id += delta;
+    }
+    for (size_t l = 1; l < n && count > 0; l++) {
+        p = ti->postings + lists[l]->offset;
+        uint32_t remaining = lists[l]->count;
+        uint32_t cur = 0;
+        size_t kept = 0;
+        id = 0;
+        int have = 0;
+        for (size_t i = 0; i < count; i++) {
+            while ((!have || cur < ids[i]) && remaining > 0) {
+                uint32_t delta;
+                p = varint_get(p, &delta);
+                cur = id += delta;
+                remaining--;
+                have = 1;
+            }
+            if (have && cur == ids[i]) ids[kept++] = ids[i];
+            else if (cur < ids[i]) break;  // List exhausted
+        }
+        count = kept;
+    }
+    free(lists);
+    *out = ids;
+    return count;
+}
+
+int search_main(int argc, char* argv[]) {
+    size_t limit = SIZE_MAX;
+    int opt;
+    while ((opt = getopt(argc, argv, "l:")) != -1) {
+        switch (opt) {
+        case 'l': limit = strtoull(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "Usage: scanner search [-l limit] <index_file> <substring>\n");
+            return 1;
+        }
+    }
+    if (optind != argc - 2) {
+        fprintf(stderr, "Usage: scanner search [-l limit] <index_file> <substring>\n");
+        return 1;
+    }
+    TrigramIndex ti;
+    if (trigram_index_open(&ti, argv[optind]) != 0) {
+        return 1;
+    }
+    const char* needle = argv[optind + 1];
+    size_t found = 0;
+    if (strlen(needle) < 3) {
+        // Too short for trigrams: scan every basename
+        for (uint64_t id = 0; id < ti.header->n_paths && found < limit; id++) {
+            const char* path = ti.paths + ti.path_offsets[id];
+            if (strstr(path_basename(path), needle)) {
+                puts(path);
+                found++;
+            }
+        }
+    } else {
+        uint32_t* ids;
+        size_t n = trigram_candidates(&ti, needle, &ids);
+        for (size_t i = 0; i < n && found < limit; i++) {
+            const char* path = ti.paths + ti.path_offsets[ids[i]];
+            if (strstr(path_basename(path), needle)) {  // Trigrams may match out of order
+                puts(path);
+                found++;
+            }
+        }
+        free(ids);
+    }
+    munmap((void*)ti.base, ti.size);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && strcmp(argv[1], "query") == 0) {
+        return query_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+        return serve_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "client") == 0) {
+        return client_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "search") == 0) {
+        return search_main(argc - 1, argv + 1);
+    }
+
+    const char* trigram_file = NULL;
+    const char* usage_file = NULL;
+    int probe = 0;
+    int classify = 0;
+    int shards = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:u:p:xmLPeM:E:S:T:R:I:")) != -1) {
+        switch (opt) {
+        case 'M': queue_window = atoi(optarg); break;
+        case 'S': {
+            char* end;
+            shards = (int)strtol(optarg, &end, 10);
+            shard_by_top = strcmp(end, ":top") == 0;
+            if (shards < 1 || shards > 1024 || (*end && !shard_by_top)) {
+                fprintf(stderr, "Bad shard spec: %s (want count or count:top)\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'E':
+            if (strcmp(optarg, "async") == 0) {
+                async_engine = 1;
+            } else if (strcmp(optarg, "threads") != 0) {
+                fprintf(stderr, "Unknown engine: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'L': follow_links = 1; break;
+        case 'P': profiling = 1; break;
+        case 'e': error_records = 1; break;
+        case 'R':
+            if (throttle_parse(optarg) != 0) return 1;
+            break;
+        case 'I':
+            if (stage_priority_parse(optarg) != 0) return 1;
+            break;
+        case 'T': {
+            // file[:N] records one directory visit in N
+            char* colon = strrchr(optarg, ':');
+            if (colon && colon[1] && strspn(colon + 1, "0123456789") == strlen(colon + 1)) {
+                trace_every = atoi(colon + 1);
+                if (trace_every < 1 || colon == optarg) {
+                    fprintf(stderr, "Bad trace spec: %s (want file or file:N)\n", optarg);
+                    return 1;
+                }
+                *colon = '\0';
+            }
+            trace_file = optarg;
+            break;
+        }
+        case 'm': classify = 1; break;
+        case 'x': collect_xattrs = 1; break;
+        case 'n': trigram_file = optarg; break;
+        case 'u': usage_file = optarg; break;
+        case 'p':
+            probe = 1;
+            probe_min_size = strtoll(optarg, NULL, 10);
+            break;
+        default: argc = 0; break;  // Force the usage message
+        }
+    }
+
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-n trigram_index] [-u usage_report] [-p probe_min_size] [-x] [-m] [-L] [-P] [-e]\n"
+                        "          [-M queue_window] [-E threads|async] [-S shards[:top]] [-T trace.json[:N]]\n"
+                        "          [-R ops[:bytes]] [-I stage=[class][:nice],...] <directory> <output_file|->\n"
+                        "       %s query <scan_file> [options]\n"
+                        "       %s serve [-i rescan_seconds] [-m metrics_socket|host:port] [-R ops[:bytes]]\n"
+                        "                [-I stage=[class][:nice],...] <directory> <socket_path>\n"
+                        "       %s client <socket_path> list|total|search <arg> [limit]\n"
+                        "       %s search [-l limit] <index_file> <substring>\n",
+                argv[0], argv[0], argv[0], argv[0], argv[0]);
+        return 1;
+    }
+    
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    
+    const char* output_name = argv[optind + 1];
+    int to_stdout = strcmp(output_name, "-") == 0;
+    if (to_stdout && shards > 1) {
+        fprintf(stderr, "Sharded output needs a file name, not -\n");
+        return 1;
+    }
+    if (output_open(output_name, shards) != 0) {
+        return 1;
+    }
+    if (to_stdout) {
+        // The scan output keeps its own copy of stdout; progress and the
+        // summary go to stderr so they do not mix into the stream
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        setvbuf(stdout, NULL, _IOLBF, 0);
+    }
+
+    ScanIndex names;
+    memset(&names, 0, sizeof(names));
+    if (trigram_file) {
+        pthread_mutex_init(&names.mutex, NULL);
+        scan_index = &names;
+    }
+    accounting = usage_file != NULL;
+    SidePool probes;
+    if (probe) {
+        side_pool_start(&probes, PROBE_THREADS, PROBE_QUEUE_SIZE, 0, probe_extents, side_release);
+        probe_pool = &probes;
+    }
+    SidePool readers;
+    if (classify) {
+        compile_signatures();
+        side_pool_start(&readers, CONTENT_THREADS, CONTENT_QUEUE_SIZE, 1, classify_file, side_release);
+        content_pool = &readers;
+    }
+    
+    trace_epoch = now_ns();
+    run_scan(argv[optind]);
+
+    if (probe) {
+        side_pool_stop(&probes);
+        probe_pool = NULL;
+    }
+    if (classify) {
+        side_pool_stop(&readers);
+        content_pool = NULL;
+    }
+    int64_t apparent = 0, allocated = 0;
+    long sparse = 0, dangling = 0, entries = 0;
+    for (int i = 0; i < MAX_THREADS; i++) {
+        entries += workers[i].entries;
+        apparent += workers[i].apparent_bytes;
+        allocated += workers[i].allocated_bytes;
+        sparse += workers[i].sparse_files;
+        dangling += workers[i].dangling_links;
+    }
+    printf("Apparent size: %lld bytes, allocated: %lld bytes, sparse files: %ld\n",
+           (long long)apparent, (long long)allocated, sparse);
+    if (follow_links) {
+        printf("Dangling symlinks: %ld\n", dangling);
+    }
+    if (probe) {
+        printf("Extent probes skipped (pool full): %ld\n", atomic_load(&probes.dropped));
+    }
+    errors_report();
+    throttle_report();
+    if (atomic_load(&fd_budget.evictions) > 0) {
+        printf("Directory fds: %ld evicted for a budget of %d, %ld reopened\n",
+               atomic_load(&fd_budget.evictions), fd_budget.limit, atomic_load(&fd_budget.reopens));
+    }
+    
+    if (output_close() != 0) {
+        perror("Failed to write output");
+        return 1;
+    }
+    if (atomic_load(&output_async_blocks) > 0) {
+        printf("Output: %ld blocks via io_uring, %ld waits for a free buffer (%.1f ms)\n",
+               atomic_load(&output_async_blocks), atomic_load(&output_stalls),
+               (double)atomic_load(&output_stall_ns) / 1e6);
+    }
+    syscalls_report(entries);
+    if (profiling) {
+        perf_report(entries);
+    }
+    if (trace_file && trace_write(trace_file) != 0) {
+        return 1;
+    }
+    if (usage_file && write_usage_report(usage_file) != 0) {
+        return 1;
+    }
+    if (trigram_file) {
+        scan_index = NULL;
+        qsort(names.entries, names.count, sizeof(IndexEntry), compare_index_entries);
+        int err = trigram_index_write(&names, trigram_file);
+        for (size_t i = 0; i < names.count; i++) free(names.entries[i].path);
+        free(names.entries);
+        pthread_mutex_destroy(&names.mutex);
+        if (err) return 1;
+    }
+
     return 0;
 }
@@ -0,0 +1,72 @@
+#!/bin/sh
+# Scans a wide tree under a small RLIMIT_NOFILE with every fd-hungry
+# feature on (perf counters, side readers, shards) and checks that no
+# entry is lost and no open even needs an EMFILE retry: the directory fd
+# budget and the profiler must give way.
+#   usage: ./test_fd_limit.sh [scanner_binary]
+set -eu
+
+FANOUT=30
+FILES=20
+LIMIT=40
+SCANNER=${1:-}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+if [ -z "$SCANNER" ]; then
+    SCANNER=$WORK/scanner
+    cc -O2 -pthread "$(dirname "$0")/scanner.c" -o "$SCANNER"
+fi
+
+# 30 x 30 directories with a few small files in each, far more than fit
+# the budget at once
+i=0
+while [ "$i" -lt "$FANOUT" ]; do
+    j=0
+    while [ "$j" -lt "$FANOUT" ]; do
+        mkdir -p "$WORK/tree/d$i/d$j"
+        k=0
+        while [ "$k" -lt "$FILES" ]; do
+            echo data >"$WORK/tree/d$i/d$j/f$k"
+            k=$((k + 1))
+        done
+        j=$((j + 1))
+    done
+    i=$((i + 1))
+done
+entries=$(find "$WORK/tree" -mindepth 1 | wc -l)
+files=$(find "$WORK/tree" -type f | wc -l)
+
+fail=0
+check() {  # check <label> <pattern> <expected> <files...>
+    label=$1 pattern=$2 expected=$3
+    shift 3
+    n=$(cat "$@" | grep -c "$pattern" || true)
+    if [ "$n" -ne "$expected" ]; then
+        echo "FAIL $label: $n of $expected '$pattern' records"
+        fail=1
+    else
+        echo "ok   $label: $n '$pattern' records"
+    fi
+}
+
+for flags in "-e" "-e -P" "-e -P -x -m -p 0 -S 4"; do
+    rm -f "$WORK"/out*
+    # shellcheck disable=SC2086
+    (ulimit -n "$LIMIT" && "$SCANNER" $flags "$WORK/tree" "$WORK/out") >"$WORK/err" 2>&1 || {
+        echo "FAIL [$flags]: scanner exited with $?"
+        fail=1
+    }
+    echo "ulimit -n $LIMIT, $flags:"
+    check "entries" "^Type: " "$entries" "$WORK"/out*
+    check "errors" "^Error: " 0 "$WORK"/out*
+    case $flags in
+        *-m*) check "content" "^Content: " "$files" "$WORK"/out* ;;
+    esac
+    if ! grep -q "^Errors: none (0 total), transient retries: 0$" "$WORK/err"; then
+        grep "^Errors" "$WORK/err" || echo "FAIL no error summary"
+        fail=1
+    fi
+done
+
+[ "$fail" -eq 0 ] || { cat "$WORK/err"; exit 1; }
@@ -0,0 +1,65 @@
+#!/bin/sh
+# Scans a tree whose paths run well past PATH_MAX and checks that every
+# level is reported, with xattrs (-x), content (-m) and extents (-p 0).
+#   usage: ./test_long_paths.sh [scanner_binary]
+set -eu
+
+DEPTH=40
+SCANNER=${1:-}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+if [ -z "$SCANNER" ]; then
+    SCANNER=$WORK/scanner
+    cc -O2 -pthread "$(dirname "$0")/scanner.c" -o "$SCANNER"
+fi
+
+# 40 levels of 203-character names (~8 KB paths), one small file and one
+# user xattr per level. Built through directory fds since no single path
+# call could reach the bottom.
+python3 - "$WORK/tree" "$DEPTH" <<'EOF'
+import os, sys
+root, depth = sys.argv[1], int(sys.argv[2])
+os.mkdir(root)
+fd = os.open(root, os.O_RDONLY | os.O_DIRECTORY)
+for i in range(depth):
+    name = "L%02d" % i + "x" * 200
+    os.mkdir(name, dir_fd=fd)
+    nfd = os.open(name, os.O_RDONLY | os.O_DIRECTORY, dir_fd=fd)
+    os.close(fd)
+    fd = nfd
+    f = os.open("file", os.O_WRONLY | os.O_CREAT, 0o644, dir_fd=fd)
+    os.write(f, b"#!/bin/sh\n" * 10)
+    os.setxattr(f, "user.k", b"v")
+    os.close(f)
+os.close(fd)
+EOF
+
+fail=0
+check() {  # check <label> <pattern> <expected> <file>
+    n=$(grep -c "$2" "$4" || true)
+    if [ "$n" -ne "$3" ]; then
+        echo "FAIL $1: $n of $3 '$2' records"
+        fail=1
+    else
+        echo "ok   $1: $n '$2' records"
+    fi
+}
+
+"$SCANNER" -e -x -m -p 0 "$WORK/tree" "$WORK/out" >"$WORK/err" 2>&1
+check "files" "^Type: Regular File" "$DEPTH" "$WORK/out"
+check "xattrs" "^Xattrs: " "$DEPTH" "$WORK/out"
+check "content" "^Content: " "$DEPTH" "$WORK/out"
+check "extents" "^Data: 100 bytes" "$DEPTH" "$WORK/out"
+check "errors" "^Error: " 0 "$WORK/out"
+
+longest=$(sed -n 's/^Path: //p' "$WORK/out" | awk '{ if (length > n) n = length } END { print n }')
+expected=$(( ${#WORK} + 5 + DEPTH * 204 + 5 ))
+if [ "$longest" -ne "$expected" ]; then
+    echo "FAIL longest path is $longest bytes, expected $expected"
+    fail=1
+else
+    echo "ok   longest path is $longest bytes"
+fi
+
+[ "$fail" -eq 0 ] || { cat "$WORK/err"; exit 1; }